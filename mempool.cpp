@@ -1,11 +1,25 @@
 #ifdef _WIN32
 #include <windows.h>
+#include <intrin.h>
 #else
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAS_SSE2
+#endif
 #include "mempool.h"
 
 /*//////////////////////////////////////////////////////////////////////////
@@ -16,20 +30,115 @@ Alignment macros
     (((size) + ((boundary) - 1)) & ~((boundary) - 1))
 
 /** Default alignment */
-#define ALIGN_DEFAULT(size) ALIGN(size, 8)
+#define ALIGN_DEFAULT(size) ALIGN(size, MEMPOOL_ALIGNMENT)
 
+/* Default geometry, allocator_create_ex() can choose another one */
 #define MIN_ALLOC   (2 * BOUNDARY_SIZE)
 #define MAX_INDEX   20
 
 #define BOUNDARY_INDEX  12
 #define BOUNDARY_SIZE   (1 << BOUNDARY_INDEX)
 
+/* Words of the bitmap of non-empty free[] buckets */
+#define FREE_MAP_BITS   32
+#define FREE_MAP_WORDS(max_index) \
+    (((max_index) + FREE_MAP_BITS - 1) / FREE_MAP_BITS)
+
 #define SIZEOF_ALLOCATOR_T  ALIGN_DEFAULT(sizeof(allocator_t))
 #define SIZEOF_MEMNODE_T    ALIGN_DEFAULT(sizeof(memnode_t))
 #define SIZEOF_MEMPOOL_T    ALIGN_DEFAULT(sizeof(mempool_t))
 
 #define ALLOCATOR_MAX_FREE_UNLIMITED 0
 
+/* A trim period every cached node was cached before, @see allocator_trim() */
+#define EPOCH_ANY       0xffffffffU
+
+/* Shared memory segments, @see allocator_options_t::shm_name */
+#define SHM_MAGIC           0x6d706f6fU
+#define SIZEOF_SHM_SEGMENT_T    ALIGN_DEFAULT(sizeof(shm_segment_t))
+#define SIZEOF_SHM_NODE_T       ALIGN_DEFAULT(sizeof(shm_node_t))
+
+/* Memory policy of mbind(2), <numaif.h> comes with libnuma only */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE    (1 << 1)
+#endif
+/* Words of the node mask handed to mbind(2), enough for 1024 nodes */
+#define NUMA_MASK_WORDS (1024 / (sizeof(unsigned long) * 8))
+
+/* Nodes at least this large are candidates for huge pages, see
+ * ALLOCATOR_MAP_HUGETLB and ALLOCATOR_MAP_THP.
+ */
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#endif
+
+/* The per-thread node cache and the lock-free free lists only make sense
+ * when the allocator is shared between threads.
+ */
+#ifndef HAS_THREADS
+#undef ALLOCATOR_USES_THREAD_CACHE
+#undef ALLOCATOR_USES_LOCK_FREE
+#endif
+
+/* Under AddressSanitizer the unused tail of every pool node and the
+ * nodes sitting in the free lists are poisoned, so stray accesses past
+ * an allocation are reported even though the memory is still mapped.
+ * Node headers always stay accessible.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_USES_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOL_USES_ASAN
+#endif
+#endif
+
+#ifdef POOL_USES_ASAN
+#include <sanitizer/asan_interface.h>
+#define MEM_POISON(addr, size)      ASAN_POISON_MEMORY_REGION(addr, size)
+#define MEM_UNPOISON(addr, size)    ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+#define MEM_POISON(addr, size)      ((void)0)
+#define MEM_UNPOISON(addr, size)    ((void)0)
+#endif //POOL_USES_ASAN
+
+/* Debug mode: every node is mapped with an inaccessible guard page right
+ * behind endp, so that an overrun faults at once instead of corrupting
+ * the next node.  POOL_GUARD_FLUSH in addition puts every mempool_alloc()
+ * block against the end of a node of its own, and
+ * POOL_GUARD_PROTECT_FREED makes freed nodes inaccessible instead of
+ * recycling them; their address space is never reused.
+ */
+#if defined(POOL_GUARD_FLUSH) || defined(POOL_GUARD_PROTECT_FREED)
+#ifndef POOL_USES_GUARD
+#define POOL_USES_GUARD
+#endif
+#endif
+#ifdef POOL_USES_GUARD
+/* A guard page cannot be cut out of a huge page */
+#undef ALLOCATOR_MAP_HUGETLB
+#endif //POOL_USES_GUARD
+
+/* (Un)poison everything of a node but its header. */
+#define node_poison(node) \
+    MEM_POISON((char *)(node) + SIZEOF_MEMNODE_T, \
+        (size_t)((node)->endp - (char *)(node)) - SIZEOF_MEMNODE_T)
+#define node_unpoison(node) \
+    MEM_UNPOISON((char *)(node) + SIZEOF_MEMNODE_T, \
+        (size_t)((node)->endp - (char *)(node)) - SIZEOF_MEMNODE_T)
+
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+/* Bytes a thread may keep cached per size bucket; small buckets hold
+ * several nodes, the largest ones hold a single node.
+ */
+#ifndef THREAD_CACHE_BUCKET_SIZE
+#define THREAD_CACHE_BUCKET_SIZE    (128 * 1024)
+#endif
+#endif //ALLOCATOR_USES_THREAD_CACHE
+
 #ifdef HAS_THREADS
 typedef struct mutex_t {
 #ifdef _WIN32
@@ -40,63 +149,282 @@ typedef struct mutex_t {
 } mutex_t;
 #endif //HAS_THREADS
 
+#ifdef ALLOCATOR_USES_LOCK_FREE
+/* A free list head together with its ABA tag; both are swapped by a
+ * single double-width compare-and-swap.
+ */
+#if defined(_WIN64) || defined(__LP64__)
+#define FREE_LIST_ALIGNMENT 16
+#else
+#define FREE_LIST_ALIGNMENT 8
+#endif
+
+#ifdef _MSC_VER
+#define DECLARE_ALIGNED(n)  __declspec(align(n))
+#else
+#define DECLARE_ALIGNED(n)  __attribute__((aligned(n)))
+#endif
+
+typedef struct DECLARE_ALIGNED(FREE_LIST_ALIGNMENT) free_list_t {
+    struct memnode_t    *first;         /**< top of the stack */
+    size_t              tag;            /**< bumped by every pop */
+} free_list_t;
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+/* first_avail and endp lead, @see memnode_head_t */
 typedef struct memnode_t {
+    char                *first_avail;   /**< pointer to first free memory */
+    char                *endp;          /**< pointer to end of free memory */
     struct memnode_t    *next;          /**< next memnode */
     struct memnode_t    **ref;          /**< reference to self */
     unsigned int        index;          /**< size */
     unsigned int        free_index;     /**< how much free */
-    char                *first_avail;   /**< pointer to first free memory */
-    char                *endp;          /**< pointer to end of free memory */
+    unsigned int        serial;         /**< pool mark the node was got under */
+    unsigned int        epoch;          /**< trim period it was cached in, @see allocator_trim() */
+    size_t              map_size;       /**< size of the mapping, 0 if malloc'ed */
+    char                *zero_from;     /**< bytes from here to endp are still zero */
+    struct memnode_t    *left;          /**< smaller nodes, in the sink only */
+    struct memnode_t    *right;         /**< larger nodes, in the sink only */
 } memnode_t;
 
+/* The start of a shared memory segment.  Everything in the segment links
+ * by offsets from its start, the processes map it at other addresses;
+ * offset 0 stands for none.  The lists are stacks, pushed with a CAS and
+ * emptied as a whole with an exchange, so no pop ever suffers from ABA.
+ */
+typedef struct shm_segment_t {
+    unsigned int        magic;          /**< SHM_MAGIC once set up */
+    size_t              size;           /**< bytes of the segment */
+    size_t              top;            /**< first byte never carved */
+    size_t              released;       /**< nodes the allocator gave back, by next */
+    size_t              handed;         /**< batches handed off, latest first */
+    size_t              returned;       /**< batches the consumer is done with */
+} shm_segment_t;
+
+/* Put in front of every node carved from a segment */
+typedef struct shm_node_t {
+    size_t              next;           /**< next node of the batch or list */
+    size_t              batch;          /**< next batch, on the first node of one */
+    size_t              size;           /**< bytes of the node behind */
+    size_t              begin;          /**< bytes handed off, [begin, end) */
+    size_t              end;
+} shm_node_t;
+
+/* A segment as mapped by this process */
+typedef struct mempool_shm_t {
+    shm_segment_t       *segment;
+    size_t              size;
+    /** Name to remove on unmap, the allocator's segment only */
+    char                *name;
+    /** Batches received but not handed out yet, oldest first */
+    size_t              pending;
+#ifdef _WIN32
+    HANDLE              mapping;
+#endif
+} mempool_shm_t;
+
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+#ifdef _WIN32
+typedef DWORD           thread_key_t;
+#else
+typedef pthread_key_t   thread_key_t;
+#endif
+
+typedef struct thread_cache_t {
+    struct thread_cache_t   *next;      /**< next cache of the allocator */
+    struct thread_cache_t   **ref;      /**< reference to self */
+    struct allocator_t      *allocator;
+    /** Number of nodes held in each bucket of free[] */
+    unsigned int            *count;
+    /** Thread private lists of free nodes, indexed like allocator_t::free */
+    struct memnode_t        **free;
+} thread_cache_t;
+#endif //ALLOCATOR_USES_THREAD_CACHE
+
+#ifdef HAS_THREADS
+/* The background thread of allocator_reclaimer_start() */
+typedef struct reclaimer_t {
+    struct allocator_t  *allocator;
+    unsigned int        period_ms;
+    size_t              target_bytes;
+    /** Lock made for an allocator that had none, dropped on stop */
+    mutex_t             *own_mutex;
+#ifdef _WIN32
+    HANDLE              thread;
+    HANDLE              wakeup;
+#else
+    bool                stop;
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      wakeup;
+#endif
+} reclaimer_t;
+#endif //HAS_THREADS
+
+/* A cleanup registered on a pool, allocated from the pool itself */
+typedef struct mempool_cleanup_t {
+    struct mempool_cleanup_t    *next;
+    void                        *data;
+    void                        (*cleanup)(void *data);
+    unsigned int                serial;     /**< pool mark at registration */
+} mempool_cleanup_t;
+
+/* active leads, @see mempool_head_t */
 typedef struct mempool_t {
+    struct memnode_t    *active;
     struct mempool_t    *parent;
     struct mempool_t    *child;
     struct mempool_t    *sibling;
     struct mempool_t    **ref;
     struct allocator_t  *allocator;
+    /** Subpools of mempool_create_lazy(), linked by the owning thread alone */
+    struct mempool_t    *lazy_child;
 
-    struct memnode_t    *active;
     struct memnode_t    *self;              /* The node containing the pool itself */
     char                *self_first_avail;
+    /** The pool structure lives in the parent's memory, self is an empty
+    * node behind it that holds nothing of its own
+    */
+    bool                lazy;
+    /** Parent mark the structure of a lazy pool was allocated under */
+    unsigned int        parent_serial;
+    /** Latest mark, nodes got since then carry it, @see mempool_mark() */
+    unsigned int        serial;
+    /** Registered cleanups, the latest first, and killed ones to reuse */
+    mempool_cleanup_t   *cleanups;
+    mempool_cleanup_t   *free_cleanups;
+    /** Bytes of the nodes of the pool and its subpools, @see mempool_usage() */
+    size_t              usage;
+    /** Bytes of the nodes of the pool itself */
+    size_t              held;
+    /** Most usage may grow to, 0 for no limit */
+    size_t              limit;
+    mempool_abort_fn    abort_fn;
+    /** Most bytes of nodes kept over a clear, @see mempool_retain_set() */
+    size_t              retain;
+    bool                retain_adaptive;
+    /** Learned bytes of nodes needed between two clears */
+    size_t              retain_peak;
+    /** Most bytes held since the last clear */
+    size_t              held_peak;
 
 #ifdef HAS_THREADS
+    /** Serializes the spills of a concurrent pool, @see mempool_concurrent_enable() */
     mutex_t             *mutex;
 #endif //HAS_THREADS
+#ifdef HAS_STATS
+    /** bytes_wasted only counts the alignment here, the node tails are
+    * added up by mempool_stats_get()
+    */
+    mempool_stats_t     stats;
+#endif //HAS_STATS
 } mempool_t;
 
+/* Recycles objects of one size through an intrusive free list, the
+ * memory comes from the pool in runs of several objects.
+ */
+typedef struct mempool_slab_t {
+    struct mempool_t    *pool;
+    size_t              size;           /**< object size as asked for */
+    size_t              stride;         /**< object size as carved */
+    void                *free;          /**< freed objects, linked by their first word */
+    char                *run;           /**< rest of the latest run */
+    char                *run_end;
+    unsigned int        serial;         /**< pool mark the run cleanup is registered for */
+} mempool_slab_t;
+
 typedef struct allocator_t {
-    /** largest used index into free[], always < MAX_INDEX */
+    /** Nodes are multiples of (1 << boundary_index) bytes */
+    unsigned int    boundary_index;
+    /** Number of slots in free[] */
     unsigned int    max_index;
-    /** Total size (in BOUNDARY_SIZE multiples) of unused memory before
+    /** Size of the smallest node, a multiple of the boundary size */
+    size_t          min_alloc;
+    /** Total size (in boundary size multiples) of unused memory before
     * blocks are given back. @see apr_allocator_max_free_set().
     * @note Initialized to APR_ALLOCATOR_MAX_FREE_UNLIMITED,
     * which means to never give back blocks.
     */
     unsigned int    max_free_index;
     /**
-    * Memory size (in BOUNDARY_SIZE multiples) that currently must be freed
+    * Memory size (in boundary size multiples) that currently must be freed
     * before blocks are given back. Range: 0..max_free_index
     */
     unsigned int    current_free_index;
+    /** Memory node the nodes are placed on, -1 for none */
+    int             numa_node;
+    /** Trim period, nodes are stamped with it when cached */
+    unsigned int    epoch;
+    /** Segment the nodes are carved from, NULL for none */
+    struct mempool_shm_t    *shm;
 #ifdef HAS_THREADS
     mutex_t         *mutex;
+    /** @see allocator_reclaimer_start() */
+    struct reclaimer_t  *reclaimer;
 #endif //HAS_THREADS
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+    /** Per-thread node caches. @see allocator_thread_cache_enable() */
+    bool            cache_enabled;
+    thread_key_t    cache_key;
+    /** All caches created for this allocator, protected by mutex */
+    struct thread_cache_t   *caches;
+#endif //ALLOCATOR_USES_THREAD_CACHE
     struct mempool_t    *owner;
+    /** Bit i is set when free[i] holds nodes, bit 0 stands for the sink */
+    unsigned int        *free_map;
     /**
     * Lists of free nodes. Slot 0 is used for oversized nodes,
-    * and the slots 1..MAX_INDEX-1 contain nodes of sizes
-    * (i+1) * BOUNDARY_SIZE. Example for BOUNDARY_INDEX == 12:
+    * and the slots 1..max_index-1 contain nodes of sizes
+    * (i+1) * boundary size. Slot 0 is not a list but the root
+    * of a tree ordered by size, @see sink_insert().
+    * Example for the default geometry (BOUNDARY_INDEX == 12,
+    * MAX_INDEX == 20):
     * slot  0: nodes larger than 81920
     * slot  1: size  8192
     * slot  2: size 12288
     * ...
     * slot 19: size 81920
     */
-    struct memnode_t    *free[MAX_INDEX];
+    struct memnode_t    **free;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    /**
+    * Lock-free stacks replacing the slots 1..max_index-1 of free[].
+    * Only the sink (free[0]) is still guarded by the mutex.
+    */
+    free_list_t         *stack;
+    /** Pops in progress, counted under the phase they started in,
+    * @see lock_free_enter()
+    */
+    unsigned int        pop_phase;
+    unsigned int        pops[2];
+    /** Nodes taken off the stacks for good, waiting for the pops that
+    * may still read them, protected by mutex. @see lock_free_reclaim()
+    */
+    struct memnode_t    *retired;
+    struct memnode_t    *retiring;
+#endif //ALLOCATOR_USES_LOCK_FREE
+#ifdef HAS_STATS
+    /** Counters, @see allocator_stats_get() */
+    size_t              sys_allocs;
+    size_t              sys_frees;
+    size_t              bytes_sys;
+    size_t              bytes_cached;
+    size_t              bytes_released;
+    allocator_bucket_stats_t    *buckets;
+#endif //HAS_STATS
+    /* free_map, free, stack and buckets live right behind the structure */
 } allocator_t;
 
 
+/* The inline fast path of mempool.h reads the pool and its active node
+ * through these.
+ */
+static_assert(offsetof(mempool_t, active) == offsetof(mempool_head_t, active),
+    "mempool_head_t does not match mempool_t");
+static_assert(offsetof(memnode_t, first_avail) == offsetof(memnode_head_t, first_avail)
+    && offsetof(memnode_t, endp) == offsetof(memnode_head_t, endp),
+    "memnode_head_t does not match memnode_t");
+
 /*//////////////////////////////////////////////////////////////////////////
 Global Variables
 //////////////////////////////////////////////////////////////////////////*/
@@ -147,576 +475,3935 @@ void mutex_destroy(mutex_t *mutex)
 }
 #endif //HAS_THREADS
 
-bool allocator_create(allocator_t **allocator)
+/*//////////////////////////////////////////////////////////////////////////
+Statistics
+//////////////////////////////////////////////////////////////////////////*/
+/* Allocator counters are updated outside the lock by the thread cache and
+ * the lock-free buckets, and the usage of a pool by its subpools in other
+ * threads, so they are always changed atomically.  Returns the new value.
+ */
+static size_t counter_add(size_t *counter, size_t value)
 {
-    allocator_t    *new_allocator;
-    
-    *allocator = NULL;
-    if ((new_allocator = (allocator_t*)malloc(SIZEOF_ALLOCATOR_T)) == NULL) {
-        return false;
-    }
-    
-    memset(new_allocator, 0, SIZEOF_ALLOCATOR_T);
-    new_allocator->max_free_index = ALLOCATOR_MAX_FREE_UNLIMITED;
+#if !defined(HAS_THREADS)
+    return *counter += value;
+#elif defined(_WIN64)
+    return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)counter, (LONG64)value) + value;
+#elif defined(_WIN32)
+    return (size_t)InterlockedExchangeAdd((volatile LONG *)counter, (LONG)value) + value;
+#else
+    return __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+#endif
+}
 
-    *allocator = new_allocator;
+static size_t counter_read(size_t *counter)
+{
+#if defined(HAS_THREADS) && !defined(_WIN32)
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#else
+    return *(volatile size_t *)counter;
+#endif
+}
 
-    return true;
+static void counter_set(size_t *counter, size_t value)
+{
+#if defined(HAS_THREADS) && !defined(_WIN32)
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+#else
+    *(volatile size_t *)counter = value;
+#endif
 }
 
-void allocator_destroy(allocator_t *allocator)
+#ifdef HAS_STATS
+#define stats_add(counter, value)   ((void)counter_add(counter, value))
+#define stats_read(counter)         counter_read(counter)
+
+#define stats_bucket(allocator, index) \
+    (&(allocator)->buckets[(index) < (allocator)->max_index ? (index) : 0])
+#define stats_node_size(allocator, index) \
+    (((size_t)(index) + 1) << (allocator)->boundary_index)
+
+/* A request for a node of size 'index' was served from the free lists */
+#define stats_hit(allocator, index) \
+    stats_add(&stats_bucket(allocator, index)->hits, 1)
+/* A request for a node of size 'index' had to go to the system */
+#define stats_miss(allocator, index) \
+    stats_add(&stats_bucket(allocator, index)->misses, 1)
+
+/* A node of size 'index' enters the shared free lists */
+static void stats_node_in(allocator_t *allocator, size_t index)
 {
-    size_t        index;
-    memnode_t    *node, **ref;
-    
-    for (index = 0; index < MAX_INDEX; index++)    {
-        ref = &allocator->free[index];
-        while ((node = *ref) != NULL) {
-            *ref = node->next;
-#ifdef ALLOCATOR_USES_MAP
+    stats_add(&stats_bucket(allocator, index)->nodes, 1);
+    stats_add(&allocator->bytes_cached, stats_node_size(allocator, index));
+}
+
+/* A node of size 'index' leaves the shared free lists */
+static void stats_node_out(allocator_t *allocator, size_t index)
+{
+    stats_add(&stats_bucket(allocator, index)->nodes, (size_t)-1);
+    stats_add(&allocator->bytes_cached, 0 - stats_node_size(allocator, index));
+}
+
+static void stats_sys_alloc(allocator_t *allocator, size_t size)
+{
+    stats_add(&allocator->sys_allocs, 1);
+    stats_add(&allocator->bytes_sys, size);
+}
+
+static void stats_sys_free(allocator_t *allocator, size_t size)
+{
+    stats_add(&allocator->sys_frees, 1);
+    stats_add(&allocator->bytes_sys, 0 - size);
+    stats_add(&allocator->bytes_released, size);
+}
+#else
+#define stats_hit(allocator, index)
+#define stats_miss(allocator, index)
+#define stats_node_in(allocator, index)
+#define stats_node_out(allocator, index)
+#define stats_sys_alloc(allocator, size)
+#define stats_sys_free(allocator, size)     ((void)(allocator))
+#endif //HAS_STATS
+
+#ifdef ALLOCATOR_USES_LOCK_FREE
+#if defined(__SANITIZE_THREAD__)
+#define NO_SANITIZE_THREAD  __attribute__((no_sanitize_thread))
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define NO_SANITIZE_THREAD  __attribute__((no_sanitize("thread")))
+#endif
+#endif
+#ifndef NO_SANITIZE_THREAD
+#define NO_SANITIZE_THREAD
+#endif
+
 #ifdef _WIN32
-            UnmapViewOfFile(node);
+/* Plain loads are atomic for aligned words on Windows targets, and the
+ * Interlocked calls of every retry loop act as compiler barriers.
+ */
+#define atomic_read(mem)            (*(mem))
+#define atomic_set32(mem, val)      InterlockedExchange((volatile LONG *)(mem), (val))
+#define atomic_or32(mem, val)       InterlockedOr((volatile LONG *)(mem), (val))
+#define atomic_and32(mem, val)      InterlockedAnd((volatile LONG *)(mem), (val))
+#define atomic_add32(mem, val)      InterlockedExchangeAdd((volatile LONG *)(mem), (LONG)(val))
+#define atomic_read_sc(mem)         (*(mem))
+#define atomic_cas32(mem, with, cmp) \
+    ((unsigned int)InterlockedCompareExchange((volatile LONG *)(mem), (with), (cmp)))
 #else
-            munmap(node, -1);
+#define atomic_read(mem)            __atomic_load_n((mem), __ATOMIC_ACQUIRE)
+#define atomic_set32(mem, val)      __atomic_store_n((mem), (val), __ATOMIC_RELEASE)
+#define atomic_or32(mem, val)       __atomic_fetch_or((mem), (val), __ATOMIC_RELEASE)
+#define atomic_and32(mem, val)      __atomic_fetch_and((mem), (val), __ATOMIC_RELEASE)
+/* The pop counts need a total order between a change and a later read */
+#define atomic_add32(mem, val)      __atomic_fetch_add((mem), (val), __ATOMIC_SEQ_CST)
+#define atomic_read_sc(mem)         __atomic_load_n((mem), __ATOMIC_SEQ_CST)
+#define atomic_cas32(mem, with, cmp) \
+    __sync_val_compare_and_swap((mem), (cmp), (with))
 #endif
+
+/* Replace *list by *with if it still equals *cmp. */
+static bool free_list_cas(free_list_t *list, const free_list_t *cmp,
+                          const free_list_t *with)
+{
+#ifdef _WIN32
+#ifdef _WIN64
+    LONG64 comparand[2];
+
+    memcpy(comparand, cmp, sizeof(comparand));
+    return InterlockedCompareExchange128((volatile LONG64 *)list,
+        (LONG64)with->tag, (LONG64)with->first, comparand) != 0;
 #else
-            free(node);
-#endif //ALLOCATOR_USES_MAP
-        }
-    }
-    free(allocator);
+    LONG64 comparand, exchange;
+
+    memcpy(&comparand, cmp, sizeof(comparand));
+    memcpy(&exchange, with, sizeof(exchange));
+    return InterlockedCompareExchange64((volatile LONG64 *)list,
+        exchange, comparand) == comparand;
+#endif
+#else
+    /* x86-64 needs -mcx16 for this to become a cmpxchg16b */
+#if FREE_LIST_ALIGNMENT == 16
+    typedef unsigned __int128   free_list_word_t;
+#else
+    typedef unsigned long long  free_list_word_t;
+#endif
+    free_list_word_t comparand, exchange;
+
+    memcpy(&comparand, cmp, sizeof(comparand));
+    memcpy(&exchange, with, sizeof(exchange));
+    return __sync_bool_compare_and_swap((free_list_word_t *)list,
+        comparand, exchange);
+#endif
 }
 
-memnode_t *allocator_alloc(allocator_t *allocator, size_t in_size)
+/* Pop the top node of a lock-free stack. The node read may be popped
+ * and reused by another thread meanwhile; the tag then makes the CAS
+ * fail. This is why a node taken off a stack is not given back to the
+ * system before the pops that may still read it are done, and why the
+ * pops run between lock_free_enter() and lock_free_leave().
+ */
+NO_SANITIZE_THREAD
+static memnode_t *free_list_pop(free_list_t *list)
 {
-    memnode_t    *node, **ref;
-    size_t        max_index, size, i, index;
+    free_list_t    cmp, with;
 
-    /* Round up the block size to the next boundary, but always
-     * allocate at least a certain size (MIN_ALLOC).
-     */
-    // 2013_07_23(Tue) : ûмSIZEOF_MEMNODE_T¸ڴ⣬ġ
-    size = ALIGN(in_size + SIZEOF_MEMNODE_T, BOUNDARY_SIZE);
-    if (size < in_size) {
-        return NULL;
-    }
-    if (size < MIN_ALLOC) {
-        size = MIN_ALLOC;
-    }
+    do {
+        cmp.tag = atomic_read(&list->tag);
+        cmp.first = atomic_read(&list->first);
+        if (cmp.first == NULL) {
+            return NULL;
+        }
+        with.first = cmp.first->next;
+        with.tag = cmp.tag + 1;
+    } while (!free_list_cas(list, &cmp, &with));
 
-    /* Find the index for this node size by
-     * dividing its size by the boundary size
-     */
-    index = (size >> BOUNDARY_INDEX) - 1;
-    
-    if (index > 0xffffffffU) {
-        return NULL;
-    }
+    return cmp.first;
+}
 
-    if (index < allocator->max_index) {
-#ifdef HAS_THREADS
-        if (allocator->mutex)
-            mutex_lock(allocator->mutex);
-#endif //HAS_THREADS
-        /* Walk the free list to see if there are
-         * any nodes on it of the requested size
-         *
-         * NOTE: an optimization would be to check
-         * allocator->free[index] first and if no
-         * node is present, directly use
-         * allocator->free[max_index].  This seems
-         * like overkill though and could cause
-         * memory waste.
-         */
-        max_index = allocator->max_index;
-        ref = &allocator->free[index];
-        i = index;
-        while (*ref == NULL && i < max_index) {
-            ref++;
-            i++;
-        }
+NO_SANITIZE_THREAD
+static void free_list_push(free_list_t *list, memnode_t *node)
+{
+    free_list_t    cmp, with;
 
-        if ((node = *ref) != NULL) {
-            /* If we have found a node and it doesn't have any
-             * nodes waiting in line behind it _and_ we are on
-             * the highest available index, find the new highest
-             * available index
-             */
-            if ((*ref = node->next) == NULL && i >= max_index) {
-                do {
-                    ref--;
-                    max_index--;
-                }
-                while (*ref == NULL && max_index > 0);
+    with.first = node;
+    do {
+        cmp.tag = atomic_read(&list->tag);
+        cmp.first = atomic_read(&list->first);
+        node->next = cmp.first;
+        with.tag = cmp.tag;
+    } while (!free_list_cas(list, &cmp, &with));
+}
 
-                allocator->max_index = max_index;
-            }
+/* A node of size 'index' leaves the free lists. */
+static void lock_free_take(allocator_t *allocator, size_t index)
+{
+    unsigned int    current, next, max_free_index;
 
-            allocator->current_free_index += node->index + 1;
-            if (allocator->current_free_index > allocator->max_free_index)
-                allocator->current_free_index = allocator->max_free_index;
-#ifdef HAS_THREADS
-            if (allocator->mutex)
-                mutex_unlock(allocator->mutex);
-#endif //HAS_THREADS
-            
-            node->next = NULL;
-            node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+    max_free_index = atomic_read(&allocator->max_free_index);
+    do {
+        current = atomic_read(&allocator->current_free_index);
+        next = current + (unsigned int)index + 1;
+        if (next > max_free_index)
+            next = max_free_index;
+    } while (atomic_cas32(&allocator->current_free_index, next, current) != current);
+    stats_node_out(allocator, index);
+}
 
-            return node;
+/* A node of size 'index' is about to enter the free lists. Returns false
+ * if it has to be given back to the system instead.
+ */
+static bool lock_free_give(allocator_t *allocator, size_t index)
+{
+    unsigned int    current, next, max_free_index;
+
+    max_free_index = atomic_read(&allocator->max_free_index);
+    do {
+        current = atomic_read(&allocator->current_free_index);
+        if (max_free_index != ALLOCATOR_MAX_FREE_UNLIMITED
+            && index + 1 > current) {
+            return false;
         }
-#ifdef HAS_THREADS
-        if (allocator->mutex)
-            mutex_unlock(allocator->mutex);
-#endif //HAS_THREADS
-    }
-    /* If we found nothing, seek the sink (at index 0), if
-     * it is not empty.
-     */
-    else if (allocator->free[0]) {
-#ifdef HAS_THREADS
-        if (allocator->mutex)
-            mutex_lock(allocator->mutex);
-#endif //HAS_THREADS
+        next = current >= index + 1 ? current - (unsigned int)index - 1 : 0;
+    } while (atomic_cas32(&allocator->current_free_index, next, current) != current);
+    stats_node_in(allocator, index);
 
-        /* Walk the free list to see if there are
-         * any nodes on it of the requested size
-         */
-        ref = &allocator->free[0];
-        while ((node = *ref) != NULL && index > node->index)
-            ref = &node->next;
+    return true;
+}
 
-        if (node) {
-            *ref = node->next;
+/* Count a pop under the current phase, returns the slot to hand to
+ * lock_free_leave().
+ */
+static unsigned int lock_free_enter(allocator_t *allocator)
+{
+    unsigned int    phase;
 
-            allocator->current_free_index += node->index + 1;
-            if (allocator->current_free_index > allocator->max_free_index)
-                allocator->current_free_index = allocator->max_free_index;
+    for (;;) {
+        phase = atomic_read_sc(&allocator->pop_phase);
+        atomic_add32(&allocator->pops[phase & 1], 1);
+        /* Counted under a phase that has just ended, and not reading a
+         * stack yet: start over under the new one.
+         */
+        if (atomic_read_sc(&allocator->pop_phase) == phase) {
+            return phase & 1;
+        }
+        atomic_add32(&allocator->pops[phase & 1], (unsigned int)-1);
+    }
+}
 
-#ifdef HAS_THREADS
-            if (allocator->mutex)
-                mutex_unlock(allocator->mutex);
-#endif //HAS_THREADS
+#define lock_free_leave(allocator, slot) \
+    atomic_add32(&(allocator)->pops[slot], (unsigned int)-1)
 
-            node->next = NULL;
-            node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+/* Retire a list of nodes taken off the stacks for good, and move the
+ * retired nodes no pop can reach any more onto 'release', to go back to
+ * the system.  The caller holds the lock.  Once the pops of the previous
+ * phase are done, the retired nodes move to retiring and a new phase
+ * begins; once the pops of the phase that ended then are done too, every
+ * pop that started before the nodes were retired is over.
+ */
+static memnode_t *lock_free_reclaim(allocator_t *allocator, memnode_t *retire,
+                                    memnode_t *release)
+{
+    memnode_t       *node;
+    unsigned int    phase;
 
-            return node;
+    while ((node = retire) != NULL) {
+        retire = node->next;
+        node->next = allocator->retired;
+        allocator->retired = node;
+    }
+    while (allocator->retiring != NULL || allocator->retired != NULL) {
+        phase = allocator->pop_phase;
+        if (atomic_read_sc(&allocator->pops[(phase - 1) & 1]) != 0) {
+            break;
         }
-#ifdef HAS_THREADS
-        if (allocator->mutex)
-            mutex_unlock(allocator->mutex);
-#endif //HAS_THREADS
+        while ((node = allocator->retiring) != NULL) {
+            allocator->retiring = node->next;
+            node->next = release;
+            release = node;
+        }
+        if (allocator->retired == NULL) {
+            break;
+        }
+        allocator->retiring = allocator->retired;
+        allocator->retired = NULL;
+        atomic_add32(&allocator->pop_phase, 1);
     }
+    return release;
+}
+#endif //ALLOCATOR_USES_LOCK_FREE
 
-    /* If we haven't got a suitable node, malloc a new one
-     * and initialize it.
-     */
-#ifdef ALLOCATOR_USES_MAP
-#ifdef _WIN32
-    HANDLE hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, 
-        PAGE_READWRITE, 0, size, NULL);
-    if (hMap == NULL) {
-        return NULL;
-    }
-    node = (memnode_t*)MapViewOfFile(hMap, FILE_MAP_READ | FILE_MAP_WRITE, 
-        0, 0, size);
-    CloseHandle(hMap);
-    if (node == NULL || IsBadWritePtr(node, 1)) {
+/*//////////////////////////////////////////////////////////////////////////
+Free list bookkeeping
+//////////////////////////////////////////////////////////////////////////*/
+static unsigned int bit_scan_forward(unsigned int bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+
+    _BitScanForward(&index, bits);
+    return (unsigned int)index;
 #else
-    node = (memnode_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
-        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (node == NULL) {
-#endif // _WIN32
+    return (unsigned int)__builtin_ctz(bits);
+#endif
+}
+
+#define free_map_test(map, index) \
+    ((free_map_word(map, (index) / FREE_MAP_BITS) >> ((index) % FREE_MAP_BITS)) & 1U)
+#ifdef ALLOCATOR_USES_LOCK_FREE
+#define free_map_word(map, word)    atomic_read(&(map)[word])
+#define free_map_set(map, index) \
+    atomic_or32(&(map)[(index) / FREE_MAP_BITS], 1U << ((index) % FREE_MAP_BITS))
+#define free_map_clear(map, index) \
+    atomic_and32(&(map)[(index) / FREE_MAP_BITS], ~(1U << ((index) % FREE_MAP_BITS)))
+#define free_index_take(allocator, index)   lock_free_take(allocator, index)
 #else
-    if ((node = (memnode_t*)malloc(size)) == NULL) {        
-#endif    //ALLOCATOR_USES_MAP
-        return NULL;
-    }
-    node->next = NULL;
-    node->index = index;
-    node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
-    node->endp = (char *)node + size;
+/* The words only change under the mutex, but allocator_alloc() peeks
+ * at them without it.
+ */
+#if defined(HAS_THREADS) && !defined(_WIN32)
+#define free_map_load(word)         __atomic_load_n(word, __ATOMIC_RELAXED)
+#define free_map_store(word, bits)  __atomic_store_n(word, bits, __ATOMIC_RELAXED)
+#else
+#define free_map_load(word)         (*(volatile unsigned int *)(word))
+#define free_map_store(word, bits)  (*(volatile unsigned int *)(word) = (bits))
+#endif
+#define free_map_word(map, word)    free_map_load(&(map)[word])
+#define free_map_set(map, index) \
+    free_map_store(&(map)[(index) / FREE_MAP_BITS], \
+        free_map_word(map, (index) / FREE_MAP_BITS) | 1U << ((index) % FREE_MAP_BITS))
+#define free_map_clear(map, index) \
+    free_map_store(&(map)[(index) / FREE_MAP_BITS], \
+        free_map_word(map, (index) / FREE_MAP_BITS) & ~(1U << ((index) % FREE_MAP_BITS)))
+
+/* A node of size 'index' leaves the free lists, the caller holds the lock. */
+static void free_index_take(allocator_t *allocator, size_t index)
+{
+    allocator->current_free_index += (unsigned int)index + 1;
+    if (allocator->current_free_index > allocator->max_free_index)
+        allocator->current_free_index = allocator->max_free_index;
+    stats_node_out(allocator, index);
+}
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+/* Pop the first node of bucket 'index'; unless the buckets are lock-free,
+ * the caller holds the lock.
+ */
+static memnode_t *bucket_pop(allocator_t *allocator, size_t index)
+{
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    return free_list_pop(&allocator->stack[index]);
+#else
+    memnode_t    *node;
 
+    if ((node = allocator->free[index]) != NULL
+        && (allocator->free[index] = node->next) == NULL) {
+        free_map_clear(allocator->free_map, index);
+    }
     return node;
+#endif
 }
 
-void allocator_free(allocator_t *allocator, memnode_t *node)
+/* Return the smallest index >= 'index' of a non-empty bucket, or 0 if
+ * there is none. 'index' must be below max_index.
+ */
+static size_t free_map_find(allocator_t *allocator, size_t index)
 {
-    memnode_t    *next, *freelist = NULL;
-    size_t        index, max_index;
-    size_t        max_free_index, current_free_index;
+    const unsigned int  *map = allocator->free_map;
+    size_t              word = index / FREE_MAP_BITS;
+    unsigned int        bits;
 
-#ifdef HAS_THREADS
-    if (allocator->mutex)
-        mutex_lock(allocator->mutex);
-#endif /* HAS_THREADS */
+    bits = free_map_word(map, word) & (~0U << (index % FREE_MAP_BITS));
+    while (bits == 0) {
+        if (++word == FREE_MAP_WORDS(allocator->max_index)) {
+            return 0;
+        }
+        bits = free_map_word(map, word);
+    }
+    return word * FREE_MAP_BITS + bit_scan_forward(bits);
+}
 
-    max_index = allocator->max_index;
-    max_free_index = allocator->max_free_index;
-    current_free_index = allocator->current_free_index;
+/* The sink holds the nodes too large for the buckets in a treap keyed on
+ * memnode_t::index, so that the best fit is found in O(log n). Nodes of
+ * equal size hang off the tree node through their next links. The heap
+ * priorities are derived from the node addresses.
+ */
+#define sink_priority(node) \
+    ((unsigned int)(((size_t)(node) >> 4) * 2654435761U))
 
-    /* Walk the list of submitted nodes and free them one by one,
-     * shoving them in the right 'size' buckets as we go.
+static void sink_rotate_left(memnode_t **ref)
+{
+    memnode_t    *node = *ref, *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    *ref = right;
+}
+
+static void sink_rotate_right(memnode_t **ref)
+{
+    memnode_t    *node = *ref, *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    *ref = left;
+}
+
+static void sink_insert(memnode_t **ref, memnode_t *node)
+{
+    memnode_t    *root = *ref;
+
+    if (root == NULL) {
+        node->next = node->left = node->right = NULL;
+        *ref = node;
+    }
+    else if (node->index == root->index) {
+        node->next = root->next;
+        root->next = node;
+    }
+    else if (node->index < root->index) {
+        sink_insert(&root->left, node);
+        if (sink_priority(root->left) > sink_priority(root))
+            sink_rotate_right(ref);
+    }
+    else {
+        sink_insert(&root->right, node);
+        if (sink_priority(root->right) > sink_priority(root))
+            sink_rotate_left(ref);
+    }
+}
+
+/* Remove and return the smallest node of at least 'index', or NULL. */
+static memnode_t *sink_take(memnode_t **root, size_t index)
+{
+    memnode_t    *node, **ref, **fit = NULL;
+
+    for (ref = root; (node = *ref) != NULL; ) {
+        if (node->index == index) {
+            fit = ref;
+            break;
+        }
+        if (node->index > index) {
+            fit = ref;
+            ref = &node->left;
+        }
+        else {
+            ref = &node->right;
+        }
+    }
+    if (fit == NULL) {
+        return NULL;
+    }
+
+    node = *fit;
+    if (node->next != NULL) {
+        /* Take a node of the same size, the tree stays as is */
+        memnode_t *same = node->next;
+        node->next = same->next;
+        return same;
+    }
+
+    /* Rotate the node down until it has at most one child, then
+     * unlink it.
      */
+    ref = fit;
+    while (node->left != NULL && node->right != NULL) {
+        if (sink_priority(node->left) > sink_priority(node->right)) {
+            sink_rotate_right(ref);
+            ref = &(*ref)->right;
+        }
+        else {
+            sink_rotate_left(ref);
+            ref = &(*ref)->left;
+        }
+    }
+    *ref = node->left != NULL ? node->left : node->right;
+
+    return node;
+}
+
+/* Turn the sink into a plain list, prepended to 'list'. */
+static memnode_t *sink_flatten(memnode_t *root, memnode_t *list)
+{
+    memnode_t    *node, *next;
+
+    if (root == NULL) {
+        return list;
+    }
+    list = sink_flatten(root->left, list);
+    list = sink_flatten(root->right, list);
+    for (node = root; node != NULL; node = next) {
+        next = node->next;
+        node->next = list;
+        list = node;
+    }
+    return list;
+}
+
+#ifdef ALLOCATOR_USES_LOCK_FREE
+/* Pop a node from the smallest non-empty bucket of at least 'index'. */
+static memnode_t *lock_free_alloc(allocator_t *allocator, size_t index)
+{
+    memnode_t       *node = NULL;
+    size_t          i = index;
+    unsigned int    slot = lock_free_enter(allocator);
+
+    while ((i = free_map_find(allocator, i)) != 0) {
+        if ((node = bucket_pop(allocator, i)) != NULL) {
+            lock_free_take(allocator, node->index);
+            break;
+        }
+
+        /* The bucket ran dry, clear its bit. A push may have slipped in
+         * before the clear, so check again.
+         */
+        free_map_clear(allocator->free_map, i);
+        if (atomic_read(&allocator->stack[i].first) != NULL)
+            free_map_set(allocator->free_map, i);
+        if (++i == allocator->max_index)
+            break;
+    }
+    lock_free_leave(allocator, slot);
+    return node;
+}
+
+/* Push a node onto its bucket and flag the bucket as non-empty. */
+static void lock_free_free(allocator_t *allocator, memnode_t *node)
+{
+    size_t          index = node->index;
+
+    free_list_push(&allocator->stack[index], node);
+    free_map_set(allocator->free_map, index);
+}
+
+/* Take the whole stack of bucket 'index'. Like a pop it bumps the tag,
+ * and the nodes' headers may still be read by a racing pop.
+ */
+NO_SANITIZE_THREAD
+static memnode_t *lock_free_detach(allocator_t *allocator, size_t index)
+{
+    free_list_t    *list = &allocator->stack[index];
+    free_list_t    cmp, with;
+
+    with.first = NULL;
+    do {
+        cmp.tag = atomic_read(&list->tag);
+        cmp.first = atomic_read(&list->first);
+        if (cmp.first == NULL) {
+            return NULL;
+        }
+        with.tag = cmp.tag + 1;
+    } while (!free_list_cas(list, &cmp, &with));
+
+    return cmp.first;
+}
+
+/* Push back a list of nodes taken by lock_free_detach(). */
+NO_SANITIZE_THREAD
+static void lock_free_attach(allocator_t *allocator, size_t index, memnode_t *first)
+{
+    free_list_t    *list = &allocator->stack[index];
+    free_list_t    cmp, with;
+    memnode_t      *last;
+
+    for (last = first; last->next != NULL; last = last->next)
+        ;
+    with.first = first;
+    do {
+        cmp.tag = atomic_read(&list->tag);
+        cmp.first = atomic_read(&list->first);
+        last->next = cmp.first;
+        with.tag = cmp.tag;
+    } while (!free_list_cas(list, &cmp, &with));
+    free_map_set(allocator->free_map, index);
+}
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+static void allocator_free_shared(allocator_t *allocator, memnode_t *node);
+
+/* Number of nodes a thread may keep cached in the bucket 'index'. */
+static size_t thread_cache_limit(allocator_t *allocator, size_t index)
+{
+    size_t    limit;
+
+    limit = (THREAD_CACHE_BUCKET_SIZE >> allocator->boundary_index) / (index + 1);
+    return limit > 1 ? limit : 1;
+}
+
+/* Move every node of the cache into a single list and return it. */
+static memnode_t *thread_cache_drain(thread_cache_t *cache)
+{
+    memnode_t    *node, *freelist = NULL;
+    size_t        index;
+
+    for (index = 0; index < cache->allocator->max_index; index++) {
+        while ((node = cache->free[index]) != NULL) {
+            cache->free[index] = node->next;
+            node->next = freelist;
+            freelist = node;
+        }
+        cache->count[index] = 0;
+    }
+    return freelist;
+}
+
+/* Thread exit: give the cached nodes back to the shared free lists. */
+static void thread_cache_exit(void *data)
+{
+    thread_cache_t  *cache = (thread_cache_t *)data;
+    allocator_t     *allocator = cache->allocator;
+    memnode_t       *freelist;
+
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+    if ((*cache->ref = cache->next) != NULL)
+        cache->next->ref = cache->ref;
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+
+    freelist = thread_cache_drain(cache);
+    free(cache);
+    if (freelist != NULL)
+        allocator_free_shared(allocator, freelist);
+}
+
+/* Return the calling thread's cache, creating it on first use. */
+static thread_cache_t *thread_cache_get(allocator_t *allocator)
+{
+    thread_cache_t  *cache;
+    size_t          size;
+
+#ifdef _WIN32
+    cache = (thread_cache_t *)TlsGetValue(allocator->cache_key);
+#else
+    cache = (thread_cache_t *)pthread_getspecific(allocator->cache_key);
+#endif
+    if (cache != NULL)
+        return cache;
+
+    size = ALIGN_DEFAULT(sizeof(thread_cache_t))
+        + allocator->max_index * (sizeof(memnode_t *) + sizeof(unsigned int));
+    if ((cache = (thread_cache_t *)malloc(size)) == NULL)
+        return NULL;
+    memset(cache, 0, size);
+    cache->allocator = allocator;
+    cache->free = (memnode_t **)((char *)cache + ALIGN_DEFAULT(sizeof(thread_cache_t)));
+    cache->count = (unsigned int *)(cache->free + allocator->max_index);
+
+#ifdef _WIN32
+    if (!TlsSetValue(allocator->cache_key, cache)) {
+#else
+    if (pthread_setspecific(allocator->cache_key, cache) != 0) {
+#endif
+        free(cache);
+        return NULL;
+    }
+
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+    if ((cache->next = allocator->caches) != NULL)
+        cache->next->ref = &cache->next;
+    allocator->caches = cache;
+    cache->ref = &allocator->caches;
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+
+    return cache;
+}
+
+/* Take a node of exactly 'index' from the calling thread's cache. An empty
+ * bucket is refilled with a batch of nodes from the shared free list of
+ * the same size, under a single lock. Returns NULL if neither has one.
+ */
+static memnode_t *thread_cache_alloc(allocator_t *allocator, size_t index)
+{
+    thread_cache_t  *cache;
+    memnode_t       *node;
+    size_t          batch;
+
+    if ((cache = thread_cache_get(allocator)) == NULL)
+        return NULL;
+
+    if (cache->free[index] == NULL) {
+        batch = (thread_cache_limit(allocator, index) + 1) / 2;
+
+#ifdef ALLOCATOR_USES_LOCK_FREE
+        unsigned int    slot = lock_free_enter(allocator);
+#else
+        if (allocator->mutex)
+            mutex_lock(allocator->mutex);
+#endif
+        while (cache->count[index] < batch
+            && (node = bucket_pop(allocator, index)) != NULL) {
+            free_index_take(allocator, index);
+            node->next = cache->free[index];
+            cache->free[index] = node;
+            cache->count[index]++;
+        }
+#ifdef ALLOCATOR_USES_LOCK_FREE
+        lock_free_leave(allocator, slot);
+#else
+        if (allocator->mutex)
+            mutex_unlock(allocator->mutex);
+#endif
+
+        if (cache->free[index] == NULL)
+            return NULL;
+    }
+
+    node = cache->free[index];
+    cache->free[index] = node->next;
+    cache->count[index]--;
+
+    node->next = NULL;
+    node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+    node->zero_from = node->endp;
+
+    return node;
+}
+
+/* Keep the submitted nodes in the calling thread's cache. When a bucket
+ * overflows, its older half is flushed. Returns the list of nodes that
+ * still have to go to the shared free lists.
+ */
+static memnode_t *thread_cache_free(allocator_t *allocator, memnode_t *node)
+{
+    thread_cache_t  *cache;
+    memnode_t       *next, *tail, *freelist = NULL;
+    size_t          index, keep;
+
+    if ((cache = thread_cache_get(allocator)) == NULL)
+        return node;
+
     do {
         next = node->next;
         index = node->index;
 
-        if (max_free_index != ALLOCATOR_MAX_FREE_UNLIMITED
-            && index + 1 > current_free_index) {
+        if (index >= allocator->max_index) {
             node->next = freelist;
             freelist = node;
+            continue;
         }
-        else if (index < MAX_INDEX) {
-            /* Add the node to the appropiate 'size' bucket.  Adjust
-             * the max_index when appropiate.
-             */
-            if ((node->next = allocator->free[index]) == NULL
-                && index > max_index) {
-                max_index = index;
-            }
-            allocator->free[index] = node;
-            if (current_free_index >= index + 1)
-                current_free_index -= index + 1;
-            else
-                current_free_index = 0;
+
+        node->next = cache->free[index];
+        cache->free[index] = node;
+        if (++cache->count[index] <= thread_cache_limit(allocator, index))
+            continue;
+
+        /* Keep the most recently freed half, flush the rest */
+        keep = thread_cache_limit(allocator, index) / 2;
+        cache->count[index] = (unsigned int)keep;
+        if (keep == 0) {
+            tail = cache->free[index];
+            cache->free[index] = NULL;
         }
         else {
-            /* This node is too large to keep in a specific size bucket,
-             * just add it to the sink (at index 0).
-             */
-            node->next = allocator->free[0];
-            allocator->free[0] = node;
-            if (current_free_index >= index + 1)
-                current_free_index -= index + 1;
-            else
-                current_free_index = 0;
+            node = cache->free[index];
+            while (--keep > 0)
+                node = node->next;
+            tail = node->next;
+            node->next = NULL;
         }
+        for (node = tail; node->next != NULL; node = node->next)
+            ;
+        node->next = freelist;
+        freelist = tail;
     } while ((node = next) != NULL);
 
-    allocator->max_index = max_index;
-    allocator->current_free_index = current_free_index;
-
-#ifdef HAS_THREADS
-    if (allocator->mutex)
-        mutex_unlock(allocator->mutex);
-#endif //HAS_THREADS
+    return freelist;
+}
+#endif //ALLOCATOR_USES_THREAD_CACHE
 
-    while (freelist != NULL) {
-        node = freelist;
-        freelist = node->next;
-#ifdef ALLOCATOR_USES_MAP
+/*//////////////////////////////////////////////////////////////////////////
+Shared memory
+//////////////////////////////////////////////////////////////////////////*/
+/* The lists of a segment are used from several processes, the atomics
+ * are needed with or without HAS_THREADS.
+ */
+static size_t shm_load(size_t *mem)
+{
 #ifdef _WIN32
-        UnmapViewOfFile(node);
+    return (size_t)InterlockedCompareExchangePointer((PVOID volatile *)mem, NULL, NULL);
 #else
-        munmap(node, -1);
+    return __atomic_load_n(mem, __ATOMIC_ACQUIRE);
 #endif
+}
+
+static bool shm_cas(size_t *mem, size_t cmp, size_t with)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchangePointer((PVOID volatile *)mem,
+        (PVOID)with, (PVOID)cmp) == (PVOID)cmp;
 #else
-        free(node);
-#endif //ALLOCATOR_USES_MAP
-    }
+    return __atomic_compare_exchange_n(mem, &cmp, with, false,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#endif
 }
 
+static size_t shm_exchange(size_t *mem, size_t with)
+{
+#ifdef _WIN32
+    return (size_t)InterlockedExchangePointer((PVOID volatile *)mem, (PVOID)with);
+#else
+    return __atomic_exchange_n(mem, with, __ATOMIC_ACQ_REL);
+#endif
+}
 
-void allocator_max_free_set(allocator_t *allocator, size_t in_size)
+/* Push the chain starting at offset 'first' onto the list *head, *link
+ * being the link field of its last element.
+ */
+static void shm_push(size_t *head, size_t first, size_t *link)
 {
-    size_t    max_free_index;
-    size_t    size = in_size;
+    size_t    cmp;
 
-#if HAS_THREADS
-    if (allocator->mutex)
-        mutex_lock(allocator->mutex);
-#endif /* HAS_THREADS */
+    do {
+        cmp = shm_load(head);
+        *link = cmp;
+    } while (!shm_cas(head, cmp, first));
+}
 
-    max_free_index = ALIGN(size, BOUNDARY_SIZE) >> BOUNDARY_INDEX;
-    allocator->current_free_index += max_free_index;
-    allocator->current_free_index -= allocator->max_free_index;
-    allocator->max_free_index = max_free_index;
-    if (allocator->current_free_index > max_free_index)
-        allocator->current_free_index = max_free_index;
+#define shm_ptr(shm, offset)    ((char *)(shm)->segment + (offset))
+#define shm_offset(shm, ptr)    ((size_t)((char *)(ptr) - (char *)(shm)->segment))
+/* The shared header of a node carved from a segment, and the other way */
+#define shm_node(node)          ((shm_node_t *)((char *)(node) - SIZEOF_SHM_NODE_T))
+#define shm_memnode(header)     ((memnode_t *)((char *)(header) + SIZEOF_SHM_NODE_T))
 
-#if HAS_THREADS
-    if (allocator->mutex)
-        mutex_unlock(allocator->mutex);
-#endif  /* HAS_THREADS */
+/* The node header at 'offset', NULL if it is not in the segment.  The
+ * consumer does not trust the offsets it is given.
+ */
+static shm_node_t *shm_node_at(mempool_shm_t *shm, size_t offset)
+{
+    if (offset < SIZEOF_SHM_SEGMENT_T || offset > shm->size - SIZEOF_SHM_NODE_T
+        || (offset & (ALIGN_DEFAULT(1) - 1)) != 0) {
+        return NULL;
+    }
+    return (shm_node_t *)shm_ptr(shm, offset);
 }
 
-bool mempool_create(mempool_t **newpool, mempool_t *parent, allocator_t *allocator)
+/* Map the segment 'name', made anew with 'size' bytes or, for a size of
+ * 0, an existing one.
+ */
+static mempool_shm_t *shm_map(const char *name, size_t size)
 {
-    mempool_t    *pool;
-    memnode_t    *node;
+    mempool_shm_t  *shm;
+    void           *base;
+    bool           create = size != 0;
 
-    *newpool = NULL;
-    if (!parent) {
-        parent = g_pool;
+    if (create && size < SIZEOF_SHM_SEGMENT_T) {
+        return NULL;
+    }
+    if ((shm = (mempool_shm_t *)malloc(sizeof(mempool_shm_t))) == NULL) {
+        return NULL;
+    }
+    memset(shm, 0, sizeof(mempool_shm_t));
+#ifdef _WIN32
+    if (create) {
+        shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            (DWORD)((unsigned long long)size >> 32), (DWORD)size, name);
     }
+    else {
+        shm->mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    }
+    if (shm->mapping == NULL) {
+        free(shm);
+        return NULL;
+    }
+    base = MapViewOfFile(shm->mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size);
+    if (base == NULL) {
+        CloseHandle(shm->mapping);
+        free(shm);
+        return NULL;
+    }
+    if (!create) {
+        MEMORY_BASIC_INFORMATION    info;
 
-    /* parent will always be non-NULL here except the first time a
-     * pool is created, in which case allocator is guaranteed to be
-     * non-NULL. */
-    if (allocator == NULL) {
-        allocator = parent->allocator;
+        VirtualQuery(base, &info, sizeof(info));
+        size = info.RegionSize;
     }
+#else
+    struct stat    st;
+    int            fd;
 
-    if ((node = allocator_alloc(allocator, 
-        MIN_ALLOC - SIZEOF_MEMNODE_T)) == NULL) {
-        return false;
+    fd = shm_open(name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+    if (fd < 0) {
+        free(shm);
+        return NULL;
+    }
+    if (create ? ftruncate(fd, (off_t)size) != 0
+        : fstat(fd, &st) != 0 || (size = (size_t)st.st_size) < SIZEOF_SHM_SEGMENT_T) {
+        close(fd);
+        if (create)
+            shm_unlink(name);
+        free(shm);
+        return NULL;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        if (create)
+            shm_unlink(name);
+        free(shm);
+        return NULL;
+    }
+    if (create && (shm->name = strdup(name)) == NULL) {
+        munmap(base, size);
+        shm_unlink(name);
+        free(shm);
+        return NULL;
     }
+#endif //_WIN32
+    shm->segment = (shm_segment_t *)base;
+    shm->size = size;
+    return shm;
+}
 
-    node->next = node;
-    node->ref = &node->next;
+static void shm_unmap(mempool_shm_t *shm)
+{
+    /* Nodes still handed off keep their poison, and the address range
+     * may be handed out again by mmap.
+     */
+    MEM_UNPOISON(shm->segment, shm->size);
+#ifdef _WIN32
+    UnmapViewOfFile(shm->segment);
+    CloseHandle(shm->mapping);
+#else
+    munmap(shm->segment, shm->size);
+    if (shm->name != NULL) {
+        shm_unlink(shm->name);
+        free(shm->name);
+    }
+#endif
+    free(shm);
+}
+
+/* Carve a node of 'size' bytes from the allocator's segment, preferring
+ * one of that size the allocator gave back before.
+ */
+static memnode_t *shm_node_alloc(allocator_t *allocator, size_t size, bool *fresh)
+{
+    mempool_shm_t  *shm = allocator->shm;
+    shm_segment_t  *segment = shm->segment;
+    shm_node_t     *header, *found = NULL, *last = NULL;
+    size_t         offset, next, rest = 0, top;
+
+    *fresh = false;
+    /* Take the released nodes as a whole and put back the others */
+    for (offset = shm_exchange(&segment->released, 0); offset != 0; offset = next) {
+        header = (shm_node_t *)shm_ptr(shm, offset);
+        next = header->next;
+        if (found == NULL && header->size == size) {
+            found = header;
+            continue;
+        }
+        if ((header->next = rest) == 0)
+            last = header;
+        rest = offset;
+    }
+    if (rest != 0) {
+        shm_push(&segment->released, rest, &last->next);
+    }
+
+    if (found == NULL) {
+        do {
+            top = shm_load(&segment->top);
+            if (shm->size - top < SIZEOF_SHM_NODE_T
+                || shm->size - top - SIZEOF_SHM_NODE_T < size) {
+                return NULL;
+            }
+        } while (!shm_cas(&segment->top, top, top + SIZEOF_SHM_NODE_T + size));
+        found = (shm_node_t *)shm_ptr(shm, top);
+        found->size = size;
+#ifndef _WIN32
+        /* the segment was truncated to zeros, on Windows the name may
+         * map an older segment
+         */
+        *fresh = true;
+#endif
+    }
+    return shm_memnode(found);
+}
+
+/* A node goes back to the segment, for shm_node_alloc() to reuse. */
+static void shm_node_free(allocator_t *allocator, memnode_t *node)
+{
+    shm_node_t     *header = shm_node(node);
+
+    shm_push(&allocator->shm->segment->released,
+        shm_offset(allocator->shm, header), &header->next);
+}
+
+/* Give the nodes of the batches the consumer returned to the allocator,
+ * false if there were none.
+ */
+static bool shm_reclaim(allocator_t *allocator)
+{
+    mempool_shm_t  *shm = allocator->shm;
+    shm_node_t     *header;
+    memnode_t      *node, *freelist = NULL;
+    size_t         batch, offset;
+
+    for (batch = shm_exchange(&shm->segment->returned, 0); batch != 0; ) {
+        header = (shm_node_t *)shm_ptr(shm, batch);
+        batch = header->batch;
+        for (offset = shm_offset(shm, header); offset != 0; offset = header->next) {
+            header = (shm_node_t *)shm_ptr(shm, offset);
+            node = shm_memnode(header);
+            node->next = freelist;
+            freelist = node;
+        }
+    }
+    if (freelist == NULL) {
+        return false;
+    }
+    allocator_free(allocator, freelist);
+    return true;
+}
+
+/*//////////////////////////////////////////////////////////////////////////
+Node provider
+//////////////////////////////////////////////////////////////////////////*/
+#ifdef POOL_USES_GUARD
+static size_t os_page_size(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO    info;
+
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+#endif
+
+#ifdef POOL_USES_GUARD
+/* The node lies within the first page of its mapping, @see memnode_map() */
+#define node_map_base(node) ((void *)((size_t)(node) & ~(os_page_size() - 1)))
+#else
+#define node_map_base(node) ((void *)(node))
+#endif
+
+#ifndef _WIN32
+/* Prefer the pages of [addr, addr + size) on the memory node 'numa_node'.
+ * The kernel falls back to other nodes when that one is full, or when it
+ * does not exist; then the memory just stays unbound.  Pages already
+ * touched are moved.
+ */
+static void memnode_numa_bind(void *addr, size_t size, int numa_node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long   mask[NUMA_MASK_WORDS];
+    const size_t    word_bits = sizeof(unsigned long) * 8;
+
+    if ((size_t)numa_node >= NUMA_MASK_WORDS * word_bits) {
+        return;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[numa_node / word_bits] = 1UL << (numa_node % word_bits);
+    /* maxnode counts one more than the bits the kernel is to look at */
+    syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask,
+        NUMA_MASK_WORDS * word_bits + 1, MPOL_MF_MOVE);
+#else
+    (void)addr;
+    (void)size;
+    (void)numa_node;
+#endif
+}
+#endif //_WIN32
+
+/* Map 'size' bytes for a node, placed on the allocator's memory node if
+ * it has one.  *size grows when the mapping is backed by huge pages, the
+ * length of the whole mapping is returned in *map_size.  With a guard
+ * page the node is placed so that it ends right at the guard.
+ */
+static memnode_t *memnode_map(allocator_t *allocator, size_t *size, size_t *map_size)
+{
+    memnode_t    *node;
+
+    *map_size = *size;
+#ifdef POOL_USES_GUARD
+    *map_size = ALIGN(*size, os_page_size()) + os_page_size();
+#endif
+#ifdef _WIN32
+    HANDLE hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, 
+        PAGE_READWRITE, 0, (DWORD)*map_size, NULL);
+    if (hMap == NULL) {
+        return NULL;
+    }
+    if (allocator->numa_node >= 0) {
+        node = (memnode_t*)MapViewOfFileExNuma(hMap, FILE_MAP_READ | FILE_MAP_WRITE,
+            0, 0, *map_size, NULL, (DWORD)allocator->numa_node);
+    }
+    else {
+        node = (memnode_t*)MapViewOfFile(hMap, FILE_MAP_READ | FILE_MAP_WRITE, 
+            0, 0, *map_size);
+    }
+    CloseHandle(hMap);
+    if (node == NULL || IsBadWritePtr(node, 1)) {
+        return NULL;
+    }
+#ifdef POOL_USES_GUARD
+    {
+        char     *guard = (char *)node + *map_size - os_page_size();
+        DWORD    protect;
+
+        if (!VirtualProtect(guard, os_page_size(), PAGE_NOACCESS, &protect)) {
+            UnmapViewOfFile(node);
+            return NULL;
+        }
+        node = (memnode_t *)(guard - *size);
+    }
+#endif //POOL_USES_GUARD
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#if defined(ALLOCATOR_MAP_POPULATE) && defined(MAP_POPULATE)
+    /* Prefault the whole node, hot pools touch it all anyway */
+    flags |= MAP_POPULATE;
+#endif
+    node = (memnode_t *)MAP_FAILED;
+#if defined(ALLOCATOR_MAP_HUGETLB) && defined(MAP_HUGETLB)
+    if (*size >= HUGE_PAGE_SIZE) {
+        /* Use the whole huge page, the reserved pool may be exhausted
+         * though, so fall back to normal pages below.
+         */
+        node = (memnode_t *)mmap(NULL, ALIGN(*size, HUGE_PAGE_SIZE),
+            PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (node != MAP_FAILED) {
+            *size = *map_size = ALIGN(*size, HUGE_PAGE_SIZE);
+        }
+    }
+#endif
+    if (node == MAP_FAILED) {
+        node = (memnode_t *)mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+            flags, -1, 0);
+        if (node == MAP_FAILED) {
+            return NULL;
+        }
+#if defined(ALLOCATOR_MAP_THP) && defined(MADV_HUGEPAGE)
+        if (*size >= HUGE_PAGE_SIZE) {
+            madvise(node, *map_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    /* Before the header is written, so that no page is placed yet
+     * (unless prefaulted by MAP_POPULATE)
+     */
+    if (allocator->numa_node >= 0) {
+        memnode_numa_bind(node, *map_size, allocator->numa_node);
+    }
+#ifdef POOL_USES_GUARD
+    {
+        char     *guard = (char *)node + *map_size - os_page_size();
+
+        if (mprotect(guard, os_page_size(), PROT_NONE) != 0) {
+            munmap(node, *map_size);
+            return NULL;
+        }
+        node = (memnode_t *)(guard - *size);
+    }
+#endif //POOL_USES_GUARD
+#endif // _WIN32
+
+    return node;
+}
+
+/* Get a node of 'size' bytes (a multiple of the allocator's boundary
+ * size) from the system and initialize it. The node may end up larger
+ * than asked for when it is backed by huge pages.
+ */
+static memnode_t *memnode_sys_alloc(allocator_t *allocator, size_t size)
+{
+    memnode_t    *node;
+    size_t        map_size = 0;
+    bool          zeroed = true;
+
+    /* Nodes of a segment have no guard page */
+    if (allocator->shm != NULL) {
+        if ((node = shm_node_alloc(allocator, size, &zeroed)) == NULL) {
+            return NULL;
+        }
+    }
+#if !defined(ALLOCATOR_USES_MAP) && !defined(POOL_USES_GUARD)
+    /* Only mapped memory can be placed on a memory node */
+    else if (allocator->numa_node < 0) {
+        if ((node = (memnode_t*)malloc(size)) == NULL) {        
+            return NULL;
+        }
+        zeroed = false;
+    }
+#endif
+    else {
+        if ((node = memnode_map(allocator, &size, &map_size)) == NULL) {
+            return NULL;
+        }
+    }
+    node->next = NULL;
+    node->epoch = 0;
+    node->index = (unsigned int)(size >> allocator->boundary_index) - 1;
+    node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+    node->endp = (char *)node + size;
+    /* Fresh mappings come zeroed from the system */
+    node->zero_from = zeroed ? node->first_avail : node->endp;
+    node->map_size = map_size;
+    stats_sys_alloc(allocator, size);
+
+    return node;
+}
+
+/* Give a node back to the system. */
+static void memnode_sys_free(allocator_t *allocator, memnode_t *node)
+{
+    stats_sys_free(allocator, (size_t)(node->endp - (char *)node));
+    /* the address range may be handed out again by mmap */
+    node_unpoison(node);
+
+    if (allocator->shm != NULL) {
+        shm_node_free(allocator, node);
+    }
+    else if (node->map_size != 0) {
+#ifdef _WIN32
+        UnmapViewOfFile(node_map_base(node));
+#else
+        munmap(node_map_base(node), node->map_size);
+#endif
+    }
+    else {
+        free(node);
+    }
+}
+
+#ifdef POOL_GUARD_PROTECT_FREED
+/* Instead of giving a node back, make it inaccessible for good; its pages
+ * go back to the system but its address range is never handed out again.
+ */
+static void memnode_retire(allocator_t *allocator, memnode_t *node)
+{
+    void    *base = node_map_base(node);
+
+    stats_sys_free(allocator, (size_t)(node->endp - (char *)node));
+#ifdef _WIN32
+    DWORD   protect;
+
+    VirtualProtect(base, node->map_size, PAGE_NOACCESS, &protect);
+#else
+    madvise(base, node->map_size, MADV_DONTNEED);
+    mprotect(base, node->map_size, PROT_NONE);
+#endif
+}
+#endif //POOL_GUARD_PROTECT_FREED
+
+bool allocator_create(allocator_t **allocator)
+{
+    return allocator_create_ex(allocator, NULL);
+}
+
+bool allocator_create_ex(allocator_t **allocator, const allocator_options_t *options)
+{
+    allocator_t    *new_allocator;
+    size_t        boundary_size = BOUNDARY_SIZE, min_alloc = 0;
+    size_t        max_index = MAX_INDEX, boundary_index, size, offset;
+    int           numa_node = -1;
+    const char    *shm_name = NULL;
+    size_t        shm_size = 0;
+    shm_segment_t *segment;
+    
+    *allocator = NULL;
+    if (options != NULL) {
+        if (options->boundary_size != 0)
+            boundary_size = options->boundary_size;
+        if (options->max_index != 0)
+            max_index = options->max_index;
+        min_alloc = options->min_alloc;
+        if (options->numa_bind) {
+            if (options->numa_node > 0x7fffffffU)
+                return false;
+            numa_node = (int)options->numa_node;
+        }
+        shm_name = options->shm_name;
+        shm_size = options->shm_size;
+    }
+
+    /* The boundary must be a power of 2 able to hold a node header, and
+     * there must be at least one bucket beside the sink.
+     */
+    if ((boundary_size & (boundary_size - 1)) != 0
+        || boundary_size < SIZEOF_MEMNODE_T || max_index < 2) {
+        return false;
+    }
+    for (boundary_index = 0; ((size_t)1 << boundary_index) < boundary_size; )
+        boundary_index++;
+
+    /* The smallest node has index 1, index 0 being the sink */
+    min_alloc = ALIGN(min_alloc, boundary_size);
+    if (min_alloc < 2 * boundary_size)
+        min_alloc = 2 * boundary_size;
+
+    /* Place free_map, free and stack behind the structure */
+    offset = SIZEOF_ALLOCATOR_T;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    offset = ALIGN(offset, FREE_LIST_ALIGNMENT);
+    size = offset + max_index * sizeof(free_list_t);
+#else
+    size = offset;
+#endif
+    size += max_index * sizeof(memnode_t *);
+#ifdef HAS_STATS
+    size += max_index * sizeof(allocator_bucket_stats_t);
+#endif
+    size += FREE_MAP_WORDS(max_index) * sizeof(unsigned int);
+
+    if ((new_allocator = (allocator_t*)malloc(size)) == NULL) {
+        return false;
+    }
+    
+    memset(new_allocator, 0, size);
+    new_allocator->boundary_index = (unsigned int)boundary_index;
+    new_allocator->max_index = (unsigned int)max_index;
+    new_allocator->min_alloc = min_alloc;
+    new_allocator->max_free_index = ALLOCATOR_MAX_FREE_UNLIMITED;
+    new_allocator->numa_node = numa_node;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    new_allocator->stack = (free_list_t *)((char *)new_allocator + offset);
+    new_allocator->free = (memnode_t **)(new_allocator->stack + max_index);
+#else
+    new_allocator->free = (memnode_t **)((char *)new_allocator + offset);
+#endif
+#ifdef HAS_STATS
+    new_allocator->buckets = (allocator_bucket_stats_t *)(new_allocator->free + max_index);
+    new_allocator->free_map = (unsigned int *)(new_allocator->buckets + max_index);
+#else
+    new_allocator->free_map = (unsigned int *)(new_allocator->free + max_index);
+#endif
+
+    if (shm_name != NULL) {
+        if ((new_allocator->shm = shm_map(shm_name, shm_size)) == NULL) {
+            free(new_allocator);
+            return false;
+        }
+        segment = new_allocator->shm->segment;
+#ifndef _WIN32
+        if (numa_node >= 0) {
+            memnode_numa_bind(segment, shm_size, numa_node);
+        }
+#endif
+        segment->size = shm_size;
+        segment->top = SIZEOF_SHM_SEGMENT_T;
+        segment->released = segment->handed = segment->returned = 0;
+        /* The consumer checks the magic before anything else */
+#ifdef _WIN32
+        InterlockedExchange((volatile LONG *)&segment->magic, SHM_MAGIC);
+#else
+        __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+#endif
+    }
+
+    *allocator = new_allocator;
+
+    return true;
+}
+
+void allocator_destroy(allocator_t *allocator)
+{
+    size_t        index;
+    memnode_t    *node, **ref;
+    
+    allocator_reclaimer_stop(allocator);
+
+    /* Gather every node into the plain lists of free[] first */
+    allocator->free[0] = sink_flatten(allocator->free[0], NULL);
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    for (index = 1; index < allocator->max_index; index++) {
+        allocator->free[index] = allocator->stack[index].first;
+    }
+    /* No pop is left to wait for, the retired nodes go with the sink */
+    while ((node = allocator->retiring) != NULL) {
+        allocator->retiring = node->next;
+        node->next = allocator->free[0];
+        allocator->free[0] = node;
+    }
+    while ((node = allocator->retired) != NULL) {
+        allocator->retired = node->next;
+        node->next = allocator->free[0];
+        allocator->free[0] = node;
+    }
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+    if (allocator->cache_enabled) {
+        thread_cache_t  *cache;
+
+        /* No thread may use the allocator any more; move the cached
+         * nodes onto the shared lists so they are released below.
+         */
+        allocator->cache_enabled = false;
+#ifdef _WIN32
+        TlsFree(allocator->cache_key);
+#else
+        pthread_key_delete(allocator->cache_key);
+#endif
+        while ((cache = allocator->caches) != NULL) {
+            allocator->caches = cache->next;
+            for (index = 0; index < allocator->max_index; index++) {
+                while ((node = cache->free[index]) != NULL) {
+                    cache->free[index] = node->next;
+                    node->next = allocator->free[index];
+                    allocator->free[index] = node;
+                }
+            }
+            free(cache);
+        }
+    }
+#endif //ALLOCATOR_USES_THREAD_CACHE
+
+    for (index = 0; index < allocator->max_index; index++)    {
+        ref = &allocator->free[index];
+        while ((node = *ref) != NULL) {
+            *ref = node->next;
+            memnode_sys_free(allocator, node);
+        }
+    }
+    /* Batches still handed off live on in the consumer's mapping */
+    if (allocator->shm != NULL) {
+        shm_unmap(allocator->shm);
+    }
+    free(allocator);
+}
+
+memnode_t *allocator_alloc(allocator_t *allocator, size_t in_size)
+{
+    memnode_t    *node;
+    size_t        size, index;
+#ifndef ALLOCATOR_USES_LOCK_FREE
+    size_t        i;
+#endif
+
+    /* Round up the block size to the next boundary, but always
+     * allocate at least a certain size (min_alloc).
+     */
+    // 2013_07_23(Tue) : ûмSIZEOF_MEMNODE_T¸ڴ⣬ġ
+    size = ALIGN(in_size + SIZEOF_MEMNODE_T, (size_t)1 << allocator->boundary_index);
+    if (size < in_size) {
+        return NULL;
+    }
+    if (size < allocator->min_alloc) {
+        size = allocator->min_alloc;
+    }
+
+    /* Find the index for this node size by
+     * dividing its size by the boundary size
+     */
+    index = (size >> allocator->boundary_index) - 1;
+    
+    if (index > 0xffffffffU) {
+        return NULL;
+    }
+
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+    if (allocator->cache_enabled && index < allocator->max_index
+        && (node = thread_cache_alloc(allocator, index)) != NULL) {
+        stats_hit(allocator, index);
+        node_unpoison(node);
+        return node;
+    }
+#endif //ALLOCATOR_USES_THREAD_CACHE
+
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    if (index < allocator->max_index
+        && (node = lock_free_alloc(allocator, index)) != NULL) {
+        stats_hit(allocator, index);
+        node->next = NULL;
+        node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+        node->zero_from = node->endp;
+        node_unpoison(node);
+
+        return node;
+    }
+#else
+    /* Look up the smallest non-empty bucket that fits in the bitmap
+     * (bucket 0 being the sink, a result of 0 means none).
+     */
+    if (index < allocator->max_index && free_map_find(allocator, index) != 0) {
+#ifdef HAS_THREADS
+        if (allocator->mutex)
+            mutex_lock(allocator->mutex);
+#endif //HAS_THREADS
+
+        if ((i = free_map_find(allocator, index)) != 0) {
+            node = bucket_pop(allocator, i);
+            free_index_take(allocator, node->index);
+            stats_hit(allocator, index);
+#ifdef HAS_THREADS
+            if (allocator->mutex)
+                mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+
+            node->next = NULL;
+            node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+            node->zero_from = node->endp;
+            node_unpoison(node);
+
+            return node;
+        }
+#ifdef HAS_THREADS
+        if (allocator->mutex)
+            mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+    }
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+    /* If we found nothing, seek the sink (at index 0), if
+     * it is not empty (flagged by bit 0 of the bitmap).
+     */
+    if (free_map_test(allocator->free_map, 0)) {
+#ifdef HAS_THREADS
+        if (allocator->mutex)
+            mutex_lock(allocator->mutex);
+#endif //HAS_THREADS
+
+        if ((node = sink_take(&allocator->free[0], index)) != NULL) {
+            if (allocator->free[0] == NULL) {
+                free_map_clear(allocator->free_map, 0);
+            }
+            free_index_take(allocator, node->index);
+            stats_hit(allocator, index);
+#ifdef HAS_THREADS
+            if (allocator->mutex)
+                mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+
+            node->next = NULL;
+            node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+            node->zero_from = node->endp;
+            node_unpoison(node);
+
+            return node;
+        }
+#ifdef HAS_THREADS
+        if (allocator->mutex)
+            mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+    }
+
+    /* Nodes the consumer of the segment is done with come back before
+     * more of the segment is carved.
+     */
+    if (allocator->shm != NULL && shm_reclaim(allocator)) {
+        return allocator_alloc(allocator, in_size);
+    }
+
+    /* If we haven't got a suitable node, get a new one from the system. */
+    stats_miss(allocator, index);
+    return memnode_sys_alloc(allocator, size);
+}
+
+/* Give a list of nodes back to the shared free lists. */
+static void allocator_free_shared(allocator_t *allocator, memnode_t *node)
+{
+    memnode_t    *next, *freelist = NULL;
+    size_t        index;
+
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    memnode_t    *sink = NULL, *retire = NULL;
+    unsigned int  epoch = atomic_read(&allocator->epoch);
+
+    /* Push the nodes onto their buckets without taking the mutex, only
+     * the nodes bound for the sink are left for the locked part.  A node
+     * of a bucket over max_free may have been on a stack before, and a
+     * racing pop may still read its header: it is retired instead.
+     */
+    do {
+        next = node->next;
+        index = node->index;
+        node->epoch = epoch;
+
+        if (!lock_free_give(allocator, index)) {
+            if (index < allocator->max_index) {
+                node->next = retire;
+                retire = node;
+            }
+            else {
+                node->next = freelist;
+                freelist = node;
+            }
+        }
+        else if (index < allocator->max_index) {
+            lock_free_free(allocator, node);
+        }
+        else {
+            node->next = sink;
+            sink = node;
+        }
+    } while ((node = next) != NULL);
+
+    if (sink != NULL || retire != NULL) {
+        if (allocator->mutex)
+            mutex_lock(allocator->mutex);
+        if (sink != NULL) {
+            while ((node = sink) != NULL) {
+                sink = node->next;
+                sink_insert(&allocator->free[0], node);
+            }
+            free_map_set(allocator->free_map, 0);
+        }
+        if (retire != NULL) {
+            freelist = lock_free_reclaim(allocator, retire, freelist);
+        }
+        if (allocator->mutex)
+            mutex_unlock(allocator->mutex);
+    }
+#else
+    size_t        max_free_index, current_free_index;
+
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+#endif /* HAS_THREADS */
+
+    max_free_index = allocator->max_free_index;
+    current_free_index = allocator->current_free_index;
+
+    /* Walk the list of submitted nodes and free them one by one,
+     * shoving them in the right 'size' buckets as we go.
+     */
+    do {
+        next = node->next;
+        index = node->index;
+        node->epoch = allocator->epoch;
+
+        if (max_free_index != ALLOCATOR_MAX_FREE_UNLIMITED
+            && index + 1 > current_free_index) {
+            node->next = freelist;
+            freelist = node;
+        }
+        else if (index < allocator->max_index) {
+            /* Add the node to the appropiate 'size' bucket.  Flag
+             * the bucket in the bitmap when it was empty.
+             */
+            if ((node->next = allocator->free[index]) == NULL) {
+                free_map_set(allocator->free_map, index);
+            }
+            allocator->free[index] = node;
+            stats_node_in(allocator, index);
+            if (current_free_index >= index + 1)
+                current_free_index -= index + 1;
+            else
+                current_free_index = 0;
+        }
+        else {
+            /* This node is too large to keep in a specific size bucket,
+             * just add it to the sink (at index 0).
+             */
+            if (allocator->free[0] == NULL) {
+                free_map_set(allocator->free_map, 0);
+            }
+            sink_insert(&allocator->free[0], node);
+            stats_node_in(allocator, index);
+            if (current_free_index >= index + 1)
+                current_free_index -= index + 1;
+            else
+                current_free_index = 0;
+        }
+    } while ((node = next) != NULL);
+
+    allocator->current_free_index = current_free_index;
+
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+    while (freelist != NULL) {
+        node = freelist;
+        freelist = node->next;
+        memnode_sys_free(allocator, node);
+    }
+}
+
+
+bool allocator_thread_cache_enable(allocator_t *allocator)
+{
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+    if (allocator->cache_enabled) {
+        return true;
+    }
+#ifdef _WIN32
+    if ((allocator->cache_key = TlsAlloc()) == TLS_OUT_OF_INDEXES) {
+        return false;
+    }
+#else
+    if (pthread_key_create(&allocator->cache_key, thread_cache_exit) != 0) {
+        return false;
+    }
+#endif
+    allocator->cache_enabled = true;
+    return true;
+#else
+    (void)allocator;
+    return false;
+#endif //ALLOCATOR_USES_THREAD_CACHE
+}
+
+void allocator_free(allocator_t *allocator, memnode_t *node)
+{
+#ifdef POOL_USES_ASAN
+    memnode_t    *poison;
+
+    for (poison = node; poison != NULL; poison = poison->next) {
+        node_poison(poison);
+    }
+#endif //POOL_USES_ASAN
+#ifdef POOL_GUARD_PROTECT_FREED
+    memnode_t    *next;
+
+    /* A use after free faults right away, the segment of a shared
+     * allocator cannot spare the address space.
+     */
+    if (allocator->shm == NULL) {
+        for (; node != NULL; node = next) {
+            next = node->next;
+            memnode_retire(allocator, node);
+        }
+        return;
+    }
+#endif //POOL_GUARD_PROTECT_FREED
+#ifdef ALLOCATOR_USES_THREAD_CACHE
+    if (allocator->cache_enabled
+        && (node = thread_cache_free(allocator, node)) == NULL) {
+        return;
+    }
+#endif //ALLOCATOR_USES_THREAD_CACHE
+    allocator_free_shared(allocator, node);
+}
+
+void allocator_max_free_set(allocator_t *allocator, size_t in_size)
+{
+    size_t    max_free_index;
+    size_t    size = in_size;
+
+#if HAS_THREADS
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+#endif /* HAS_THREADS */
+
+    max_free_index = ALIGN(size, (size_t)1 << allocator->boundary_index)
+        >> allocator->boundary_index;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    {
+        unsigned int    current, next;
+
+        do {
+            current = atomic_read(&allocator->current_free_index);
+            next = current + (unsigned int)max_free_index - allocator->max_free_index;
+            if (next > max_free_index)
+                next = (unsigned int)max_free_index;
+        } while (atomic_cas32(&allocator->current_free_index, next, current) != current);
+        atomic_set32(&allocator->max_free_index, (unsigned int)max_free_index);
+    }
+#else
+    allocator->current_free_index += max_free_index;
+    allocator->current_free_index -= allocator->max_free_index;
+    allocator->max_free_index = max_free_index;
+    if (allocator->current_free_index > max_free_index)
+        allocator->current_free_index = max_free_index;
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+#if HAS_THREADS
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+#endif  /* HAS_THREADS */
+}
+
+/* Bytes of the nodes of a list. */
+static size_t trim_list_size(memnode_t *node)
+{
+    size_t    size = 0;
+
+    for (; node != NULL; node = node->next) {
+        size += (size_t)(node->endp - (char *)node);
+    }
+    return size;
+}
+
+static size_t trim_sink_size(memnode_t *root)
+{
+    if (root == NULL) {
+        return 0;
+    }
+    return trim_list_size(root) + trim_sink_size(root->left) + trim_sink_size(root->right);
+}
+
+/* Unlink the sink nodes cached before the period 'before' onto 'release'
+ * while more than 'target' bytes are cached; the caller holds the lock.
+ */
+static memnode_t *trim_sink(allocator_t *allocator, unsigned int before,
+                            size_t target, size_t *cached, memnode_t *release)
+{
+    memnode_t    *node, *list;
+
+    list = sink_flatten(allocator->free[0], NULL);
+    allocator->free[0] = NULL;
+    while ((node = list) != NULL) {
+        list = node->next;
+        if (*cached > target && node->epoch < before) {
+            free_index_take(allocator, node->index);
+            *cached -= (size_t)(node->endp - (char *)node);
+            node->next = release;
+            release = node;
+        }
+        else {
+            sink_insert(&allocator->free[0], node);
+        }
+    }
+    if (allocator->free[0] == NULL) {
+        free_map_clear(allocator->free_map, 0);
+    }
+    return release;
+}
+
+/* Number of nodes of a bucket list to give back: those cached before the
+ * period 'before', least recently freed first, until 'target' is met.
+ * *skip is set to the number of such nodes to pass over first.
+ */
+static size_t trim_count(memnode_t *node, size_t size, unsigned int before,
+                         size_t target, size_t cached, size_t *skip)
+{
+    size_t    old = 0, count;
+
+    for (; node != NULL; node = node->next) {
+        if (node->epoch < before)
+            old++;
+    }
+    count = cached > target ? (cached - target + size - 1) / size : 0;
+    if (count > old)
+        count = old;
+    *skip = old - count;
+    return count;
+}
+
+#ifndef ALLOCATOR_USES_LOCK_FREE
+/* Unlink nodes of bucket 'index' onto 'release' as trim_count() says;
+ * the caller holds the lock.
+ */
+static memnode_t *trim_bucket(allocator_t *allocator, size_t index, unsigned int before,
+                              size_t target, size_t *cached, memnode_t *release)
+{
+    memnode_t    *node, **ref;
+    size_t        size = (index + 1) << allocator->boundary_index;
+    size_t        count, skip;
+
+    count = trim_count(allocator->free[index], size, before, target, *cached, &skip);
+    for (ref = &allocator->free[index]; count > 0 && (node = *ref) != NULL; ) {
+        if (node->epoch >= before || skip > 0) {
+            if (node->epoch < before)
+                skip--;
+            ref = &node->next;
+            continue;
+        }
+        *ref = node->next;
+        node->next = release;
+        release = node;
+        free_index_take(allocator, index);
+        *cached -= size;
+        count--;
+    }
+    if (allocator->free[index] == NULL) {
+        free_map_clear(allocator->free_map, index);
+    }
+    return release;
+}
+#else
+/* Unlink nodes of the lock-free bucket 'index' onto 'retire' as
+ * trim_count() says.  A racing pop may still read their headers, they
+ * go back to the system through lock_free_reclaim().
+ */
+static memnode_t *trim_lock_free(allocator_t *allocator, size_t index, unsigned int before,
+                                 size_t target, size_t *cached, memnode_t *retire)
+{
+    memnode_t    *node, *list, **ref;
+    size_t        size = (index + 1) << allocator->boundary_index;
+    size_t        count, skip;
+
+    if ((list = lock_free_detach(allocator, index)) == NULL) {
+        return retire;
+    }
+    count = trim_count(list, size, before, target, *cached, &skip);
+    for (ref = &list; count > 0 && (node = *ref) != NULL; ) {
+        if (node->epoch >= before || skip > 0) {
+            if (node->epoch < before)
+                skip--;
+            ref = &node->next;
+            continue;
+        }
+        *ref = node->next;
+        node->next = retire;
+        retire = node;
+        free_index_take(allocator, index);
+        /* The estimate may have missed nodes pushed since */
+        *cached = *cached > size ? *cached - size : 0;
+        count--;
+    }
+    if (list != NULL) {
+        lock_free_attach(allocator, index, list);
+    }
+    return retire;
+}
+#endif //ALLOCATOR_USES_LOCK_FREE
+
+/* allocator_trim() limited to the nodes cached before the period 'before'. */
+static size_t allocator_trim_before(allocator_t *allocator, size_t target_bytes,
+                                    unsigned int before)
+{
+    memnode_t    *node, *release = NULL;
+    size_t        index, cached = 0, total;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    memnode_t    *retire = NULL;
+#endif
+
+    /* The lock-free buckets do not need the lock, holding it still
+     * keeps allocator_check() and other trims out.
+     */
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+#endif //HAS_THREADS
+
+    cached += trim_sink_size(allocator->free[0]);
+    for (index = 1; index < allocator->max_index; index++) {
+#ifdef ALLOCATOR_USES_LOCK_FREE
+        /* Refilled meanwhile, so this is an estimate */
+        if ((node = lock_free_detach(allocator, index)) != NULL) {
+            cached += trim_list_size(node);
+            lock_free_attach(allocator, index, node);
+        }
+#else
+        cached += trim_list_size(allocator->free[index]);
+#endif
+    }
+    total = cached;
+
+    /* The sink first, then the buckets from the largest size down */
+    if (cached > target_bytes) {
+        release = trim_sink(allocator, before, target_bytes, &cached, release);
+    }
+    for (index = allocator->max_index - 1; index > 0 && cached > target_bytes; index--) {
+#ifdef ALLOCATOR_USES_LOCK_FREE
+        retire = trim_lock_free(allocator, index, before, target_bytes, &cached, retire);
+#else
+        release = trim_bucket(allocator, index, before, target_bytes, &cached, release);
+#endif
+    }
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    release = lock_free_reclaim(allocator, retire, release);
+#endif
+
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+
+    while ((node = release) != NULL) {
+        release = node->next;
+        memnode_sys_free(allocator, node);
+    }
+
+    return total - cached;
+}
+
+size_t allocator_trim(allocator_t *allocator, size_t target_bytes)
+{
+    return allocator_trim_before(allocator, target_bytes, EPOCH_ANY);
+}
+
+#ifdef HAS_THREADS
+/* One period of the reclaimer: a new period starts, and the nodes cached
+ * before the previous one, unused for a whole period, are given back.
+ */
+static void reclaimer_tick(allocator_t *allocator, size_t target_bytes)
+{
+    unsigned int    epoch;
+
+    mutex_lock(allocator->mutex);
+    epoch = allocator->epoch + 1;
+#ifdef ALLOCATOR_USES_LOCK_FREE
+    atomic_set32(&allocator->epoch, epoch);
+#else
+    allocator->epoch = epoch;
+#endif
+    mutex_unlock(allocator->mutex);
+
+    allocator_trim_before(allocator, target_bytes, epoch - 1);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI reclaimer_main(LPVOID data)
+{
+    reclaimer_t     *reclaimer = (reclaimer_t *)data;
+
+    while (WaitForSingleObject(reclaimer->wakeup, reclaimer->period_ms) == WAIT_TIMEOUT) {
+        reclaimer_tick(reclaimer->allocator, reclaimer->target_bytes);
+    }
+    return 0;
+}
+#else
+static void *reclaimer_main(void *data)
+{
+    reclaimer_t     *reclaimer = (reclaimer_t *)data;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    while (!reclaimer->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += reclaimer->period_ms / 1000;
+        deadline.tv_nsec += (long)(reclaimer->period_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!reclaimer->stop && pthread_cond_timedwait(&reclaimer->wakeup,
+            &reclaimer->mutex, &deadline) != ETIMEDOUT)
+            ;
+        if (reclaimer->stop)
+            break;
+
+        pthread_mutex_unlock(&reclaimer->mutex);
+        reclaimer_tick(reclaimer->allocator, reclaimer->target_bytes);
+        pthread_mutex_lock(&reclaimer->mutex);
+    }
+    pthread_mutex_unlock(&reclaimer->mutex);
+
+    return NULL;
+}
+#endif //_WIN32
+
+/* Free a reclaimer whose thread is gone or never ran. */
+static void reclaimer_free(reclaimer_t *reclaimer)
+{
+    if (reclaimer->own_mutex != NULL) {
+        reclaimer->allocator->mutex = NULL;
+        mutex_destroy(reclaimer->own_mutex);
+        free(reclaimer->own_mutex);
+    }
+#ifdef _WIN32
+    if (reclaimer->thread != NULL)
+        CloseHandle(reclaimer->thread);
+    if (reclaimer->wakeup != NULL)
+        CloseHandle(reclaimer->wakeup);
+#else
+    pthread_cond_destroy(&reclaimer->wakeup);
+    pthread_mutex_destroy(&reclaimer->mutex);
+#endif
+    free(reclaimer);
+}
+#endif //HAS_THREADS
+
+bool allocator_reclaimer_start(allocator_t *allocator, unsigned int period_ms,
+                               size_t target_bytes)
+{
+#ifdef HAS_THREADS
+    reclaimer_t    *reclaimer;
+    bool            started;
+
+    if (allocator->reclaimer != NULL || period_ms == 0) {
+        return false;
+    }
+    if ((reclaimer = (reclaimer_t *)malloc(sizeof(reclaimer_t))) == NULL) {
+        return false;
+    }
+    memset(reclaimer, 0, sizeof(reclaimer_t));
+    reclaimer->allocator = allocator;
+    reclaimer->period_ms = period_ms;
+    reclaimer->target_bytes = target_bytes;
+
+    /* The thread shares the allocator, it needs a lock */
+    if (allocator->mutex == NULL) {
+        if ((reclaimer->own_mutex = (mutex_t *)malloc(sizeof(mutex_t))) == NULL) {
+            free(reclaimer);
+            return false;
+        }
+        mutex_init(reclaimer->own_mutex);
+        allocator->mutex = reclaimer->own_mutex;
+    }
+
+#ifdef _WIN32
+    started = (reclaimer->wakeup = CreateEvent(NULL, TRUE, FALSE, NULL)) != NULL
+        && (reclaimer->thread = CreateThread(NULL, 0, reclaimer_main,
+            reclaimer, 0, NULL)) != NULL;
+#else
+    pthread_mutex_init(&reclaimer->mutex, NULL);
+    pthread_cond_init(&reclaimer->wakeup, NULL);
+    started = pthread_create(&reclaimer->thread, NULL, reclaimer_main, reclaimer) == 0;
+#endif
+    if (!started) {
+        reclaimer_free(reclaimer);
+        return false;
+    }
+    allocator->reclaimer = reclaimer;
+    return true;
+#else
+    (void)allocator;
+    (void)period_ms;
+    (void)target_bytes;
+    return false;
+#endif //HAS_THREADS
+}
+
+void allocator_reclaimer_stop(allocator_t *allocator)
+{
+#ifdef HAS_THREADS
+    reclaimer_t    *reclaimer = allocator->reclaimer;
+
+    if (reclaimer == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    SetEvent(reclaimer->wakeup);
+    WaitForSingleObject(reclaimer->thread, INFINITE);
+#else
+    pthread_mutex_lock(&reclaimer->mutex);
+    reclaimer->stop = true;
+    pthread_cond_signal(&reclaimer->wakeup);
+    pthread_mutex_unlock(&reclaimer->mutex);
+    pthread_join(reclaimer->thread, NULL);
+#endif
+    allocator->reclaimer = NULL;
+    reclaimer_free(reclaimer);
+#else
+    (void)allocator;
+#endif //HAS_THREADS
+}
+
+int allocator_numa_node(void)
+{
+#if defined(_WIN32)
+    PROCESSOR_NUMBER    processor;
+    USHORT              node;
+
+    GetCurrentProcessorNumberEx(&processor);
+    if (!GetNumaProcessorNodeEx(&processor, &node)) {
+        return 0;
+    }
+    return (int)node;
+#elif defined(__linux__) && defined(SYS_getcpu)
+    unsigned int    cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return (int)node;
+#else
+    return 0;
+#endif
+}
+
+allocator_t *allocator_numa_pick(allocator_t *const *allocators, size_t count)
+{
+    int        numa_node;
+    size_t     i;
+
+    if (count == 0) {
+        return NULL;
+    }
+    numa_node = allocator_numa_node();
+    for (i = 0; i < count; i++) {
+        if (allocators[i]->numa_node == numa_node)
+            return allocators[i];
+    }
+    return allocators[0];
+}
+
+bool allocator_stats_get(allocator_t *allocator, allocator_stats_t *stats)
+{
+#ifdef HAS_STATS
+    stats->sys_allocs = stats_read(&allocator->sys_allocs);
+    stats->sys_frees = stats_read(&allocator->sys_frees);
+    stats->bytes_sys = stats_read(&allocator->bytes_sys);
+    stats->bytes_cached = stats_read(&allocator->bytes_cached);
+    stats->bytes_released = stats_read(&allocator->bytes_released);
+    stats->boundary_size = (size_t)1 << allocator->boundary_index;
+    stats->max_index = allocator->max_index;
+    return true;
+#else
+    (void)allocator;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif //HAS_STATS
+}
+
+bool allocator_bucket_stats_get(allocator_t *allocator, size_t index,
+                                allocator_bucket_stats_t *stats)
+{
+#ifdef HAS_STATS
+    if (index >= allocator->max_index) {
+        return false;
+    }
+    stats->hits = stats_read(&allocator->buckets[index].hits);
+    stats->misses = stats_read(&allocator->buckets[index].misses);
+    stats->nodes = stats_read(&allocator->buckets[index].nodes);
+    return true;
+#else
+    (void)allocator;
+    (void)index;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif //HAS_STATS
+}
+
+/* Check a sink subtree: search tree order on index within [low, high],
+ * heap order on the priority and equal sized nodes chained off their
+ * representative. Sums up the indexes for the accounting check.
+ */
+static bool sink_check(allocator_t *allocator, memnode_t *root,
+                       size_t low, size_t high, size_t *cached)
+{
+    memnode_t    *node;
+
+    if (root == NULL) {
+        return true;
+    }
+    if (root->index < allocator->max_index
+        || root->index < low || root->index > high) {
+        return false;
+    }
+    if ((root->left && sink_priority(root->left) > sink_priority(root))
+        || (root->right && sink_priority(root->right) > sink_priority(root))) {
+        return false;
+    }
+    for (node = root; node != NULL; node = node->next) {
+        if (node->index != root->index) {
+            return false;
+        }
+        *cached += node->index + 1;
+    }
+    return sink_check(allocator, root->left, low, root->index - 1, cached)
+        && sink_check(allocator, root->right, root->index + 1, high, cached);
+}
+
+bool allocator_check(allocator_t *allocator)
+{
+    memnode_t       *node;
+    size_t          index, cached = 0;
+    unsigned int    max_free_index, current_free_index;
+    bool            ok = true;
+
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_lock(allocator->mutex);
+#endif //HAS_THREADS
+
+    /* Every node of a bucket has the bucket's size, and a non-empty
+     * bucket is flagged in the bitmap. The lock-free buckets may leave
+     * a flag behind on an empty bucket, the locked ones never do.
+     */
+    for (index = 1; ok && index < allocator->max_index; index++) {
+#ifdef ALLOCATOR_USES_LOCK_FREE
+        node = allocator->stack[index].first;
+#else
+        node = allocator->free[index];
+        if (node == NULL && free_map_test(allocator->free_map, index)) {
+            ok = false;
+        }
+#endif //ALLOCATOR_USES_LOCK_FREE
+        if (node != NULL && !free_map_test(allocator->free_map, index)) {
+            ok = false;
+        }
+        for (; ok && node != NULL; node = node->next) {
+            if (node->index != index) {
+                ok = false;
+            }
+            cached += index + 1;
+        }
+    }
+    if ((allocator->free[0] != NULL) != (free_map_test(allocator->free_map, 0) != 0)) {
+        ok = false;
+    }
+    if (ok) {
+        ok = sink_check(allocator, allocator->free[0],
+                        allocator->max_index, (size_t)-1, &cached);
+    }
+
+    /* current_free_index is what is left of the max_free_index budget
+     * after the cached nodes; lowering the budget below what is cached
+     * already leaves it at the new maximum.
+     */
+    max_free_index = allocator->max_free_index;
+    current_free_index = allocator->current_free_index;
+    if (max_free_index == ALLOCATOR_MAX_FREE_UNLIMITED) {
+        ok = ok && current_free_index == 0;
+    }
+    else {
+        ok = ok && current_free_index <= max_free_index
+            && current_free_index + cached >= max_free_index;
+    }
+
+#ifdef HAS_THREADS
+    if (allocator->mutex)
+        mutex_unlock(allocator->mutex);
+#endif //HAS_THREADS
+
+    return ok;
+}
+
+#ifdef HAS_STATS
+/* Account for a node the pool got from its allocator. */
+static void pool_stats_node(mempool_t *pool, memnode_t *node)
+{
+    pool->stats.bytes_held += (size_t)(node->endp - (char *)node);
+    if (pool->stats.bytes_held > pool->stats.bytes_held_peak)
+        pool->stats.bytes_held_peak = pool->stats.bytes_held;
+    if (++pool->stats.nodes > pool->stats.nodes_peak)
+        pool->stats.nodes_peak = pool->stats.nodes;
+}
+
+/* Account for a node the pool gave back to its allocator. */
+static void pool_stats_unnode(mempool_t *pool, memnode_t *node)
+{
+    pool->stats.bytes_held -= (size_t)(node->endp - (char *)node);
+    pool->stats.nodes--;
+}
+
+/* Forget everything but the node holding the pool structure. */
+static void pool_stats_reset(mempool_t *pool)
+{
+    pool->stats.bytes_requested = 0;
+    pool->stats.bytes_allocated = 0;
+    pool->stats.bytes_wasted = 0;
+    pool->stats.bytes_held = 0;
+    pool->stats.nodes = 0;
+    if (!pool->lazy)
+        pool_stats_node(pool, pool->self);
+}
+
+#define pool_stats_init(pool) do {                              \
+    memset(&(pool)->stats, 0, sizeof((pool)->stats));           \
+    if (!(pool)->lazy)                                          \
+        pool_stats_node(pool, (pool)->self);                    \
+} while (0)
+#define pool_stats_alloc(pool, in_size, size) do {              \
+    (pool)->stats.bytes_requested += in_size;                   \
+    (pool)->stats.bytes_allocated += size;                      \
+    (pool)->stats.bytes_wasted += size - in_size;               \
+} while (0)
+#else
+#define pool_stats_init(pool)
+#define pool_stats_reset(pool)
+#define pool_stats_node(pool, node)
+#define pool_stats_unnode(pool, node)
+#define pool_stats_alloc(pool, in_size, size)
+#endif //HAS_STATS
+
+#define node_size(node) ((size_t)((node)->endp - (char *)(node)))
+/* Bytes of the node holding the pool that count as held */
+#define pool_self_size(pool) ((pool)->lazy ? 0 : node_size((pool)->self))
+
+/* The node's first_avail is about to move back, the bytes handed out
+ * below it are no longer known to be zero.
+ */
+#define node_dirty(node) do {                                   \
+    if ((node)->first_avail > (node)->zero_from)                \
+        (node)->zero_from = (node)->first_avail;                \
+} while (0)
+
+/* The pool got a node of 'size' bytes, add it to the usage of the pool
+ * and the pools above it.  False, with nothing added, when that takes
+ * one of them over its limit.  Every pool is below g_pool, so its usage
+ * is left alone.
+ */
+static bool pool_usage_grow(mempool_t *pool, size_t size)
+{
+    mempool_t    *p, *q;
+    size_t        limit;
+
+    for (p = pool; p != NULL && p != g_pool; p = p->parent) {
+        limit = counter_read(&p->limit);
+        if (counter_add(&p->usage, size) > limit && limit != 0) {
+            for (q = pool; q != p->parent; q = q->parent)
+                counter_add(&q->usage, 0 - size);
+            return false;
+        }
+    }
+    pool->held += size;
+    if (pool->held > pool->held_peak)
+        pool->held_peak = pool->held;
+    return true;
+}
+
+/* The pool gave nodes of 'size' bytes back. */
+static void pool_usage_shrink(mempool_t *pool, size_t size)
+{
+    mempool_t    *p;
+
+    pool->held -= size;
+    for (p = pool; p != NULL && p != g_pool; p = p->parent)
+        counter_add(&p->usage, 0 - size);
+}
+
+/* The pool could not get a node for 'size' bytes. */
+#define pool_abort(pool, size) do {             \
+    if ((pool)->abort_fn != NULL)               \
+        (pool)->abort_fn(pool, size);           \
+} while (0)
+
+/* Run the cleanups registered under the mark 'serial' or a later one,
+ * latest first.  A cleanup may register further cleanups, they are run
+ * in turn.
+ */
+static void cleanups_run(mempool_t *pool, unsigned int serial)
+{
+    mempool_cleanup_t *c;
+
+    while ((c = pool->cleanups) != NULL && c->serial >= serial) {
+        pool->cleanups = c->next;
+        c->cleanup(c->data);
+    }
+}
+
+bool mempool_create(mempool_t **newpool, mempool_t *parent, allocator_t *allocator)
+{
+    mempool_t    *pool;
+    memnode_t    *node;
+
+    *newpool = NULL;
+    if (!parent) {
+        parent = g_pool;
+    }
+
+    /* parent will always be non-NULL here except the first time a
+     * pool is created, in which case allocator is guaranteed to be
+     * non-NULL. */
+    if (allocator == NULL) {
+        allocator = parent->allocator;
+    }
+
+    if ((node = allocator_alloc(allocator, 
+        allocator->min_alloc - SIZEOF_MEMNODE_T)) == NULL) {
+        if (parent != NULL)
+            pool_abort(parent, allocator->min_alloc);
+        return false;
+    }
+
+    node->next = node;
+    node->ref = &node->next;
+
+    pool = (mempool_t *)node->first_avail;
+    node->first_avail = pool->self_first_avail = (char *)pool + SIZEOF_MEMPOOL_T;
+    
+    pool->allocator = allocator;
+    pool->active = pool->self = node;
+    pool->child = pool->lazy_child = NULL;
+    pool->parent = parent;
+    pool->sibling = NULL;
+    pool->ref = NULL;
+    pool->serial = node->serial = 0;
+    pool->cleanups = pool->free_cleanups = NULL;
+    pool->usage = pool->held = pool->limit = 0;
+    pool->abort_fn = parent != NULL ? parent->abort_fn : NULL;
+    pool->retain = pool->retain_peak = pool->held_peak = 0;
+    pool->retain_adaptive = false;
+    pool->lazy = false;
+    pool->parent_serial = 0;
+#ifdef HAS_THREADS
+    pool->mutex = NULL;
+#endif
+
+    /* The new pool counts against the limits above it */
+    if (!pool_usage_grow(pool, node_size(node))) {
+        node->next = NULL;
+        allocator_free(allocator, node);
+        pool_abort(parent, allocator->min_alloc);
+        return false;
+    }
+    pool_stats_init(pool);
+    MEM_POISON(node->first_avail, (size_t)(node->endp - node->first_avail));
+    
+    if (parent != NULL) {
+#ifdef HAS_THREADS
+        mutex_t *mutex;
+        if ((mutex = parent->allocator->mutex) != NULL) {
+            mutex_lock(mutex);
+        }
+#endif /* HAS_THREADS */
+
+        if ((pool->sibling = parent->child) != NULL)
+            pool->sibling->ref = &pool->sibling;
+
+        parent->child = pool;
+        pool->ref = &parent->child;
+
+#ifdef HAS_THREADS
+        if (mutex)
+            mutex_unlock(mutex);
+#endif /* HAS_THREADS */
+    }
+    else {
+        pool->sibling = NULL;
+        pool->ref = NULL;
+    }
+    
+    *newpool = pool;
+    return true;
+}
+
+
+bool mempool_create_unmanaged(mempool_t **newpool, allocator_t *allocator)
+{
+    mempool_t    *pool;
+    memnode_t    *node;
+    allocator_t    *pool_allocator;
+
+    *newpool = NULL;
+
+    if ((pool_allocator = allocator) == NULL) {
+        if (!allocator_create(&pool_allocator)) {
+            return false;
+        }
+    }
+    if ((node = allocator_alloc(pool_allocator, 
+        pool_allocator->min_alloc - SIZEOF_MEMNODE_T)) == NULL) {
+        return false;
+    }
+
+    node->next = node;
+    node->ref = &node->next;
+
+    pool = (mempool_t *)node->first_avail;
+    node->first_avail = pool->self_first_avail = (char *)pool + SIZEOF_MEMPOOL_T;
+    
+    pool->allocator = pool_allocator;
+    pool->active = pool->self = node;
+    pool->child = pool->lazy_child = NULL;
+    pool->parent = NULL;
+    pool->sibling = NULL;
+    pool->ref = NULL;
+    pool->serial = node->serial = 0;
+    pool->cleanups = pool->free_cleanups = NULL;
+    pool->usage = pool->held = node_size(node);
+    pool->limit = 0;
+    pool->abort_fn = NULL;
+    pool->retain = pool->retain_peak = 0;
+    pool->held_peak = pool->held;
+    pool->retain_adaptive = false;
+    pool->lazy = false;
+    pool->parent_serial = 0;
+#ifdef HAS_THREADS
+    pool->mutex = NULL;
+#endif
+    pool_stats_init(pool);
+    MEM_POISON(node->first_avail, (size_t)(node->endp - node->first_avail));
+    
+    if (!allocator) {
+        pool_allocator->owner = pool;
+    }
+    *newpool = pool;
+
+    return true;
+}
+
+
+bool mempool_create_lazy(mempool_t **newpool, mempool_t *parent)
+{
+    mempool_t    *pool;
+    memnode_t    *node;
+
+    /* The pool structure comes from the parent, followed by an empty
+     * node standing in for the one that would hold it.  The first
+     * allocation finds no room there and gets a node of its own.  A
+     * block of 0 bytes does fit, at the end of the empty node: a spare
+     * unit behind it keeps that from being the parent's next block.
+     */
+    *newpool = NULL;
+    if (parent == NULL || (pool = (mempool_t *)mempool_alloc(parent,
+        SIZEOF_MEMPOOL_T + SIZEOF_MEMNODE_T + MEMPOOL_ALIGNMENT)) == NULL) {
+        return false;
+    }
+    node = (memnode_t *)((char *)pool + SIZEOF_MEMPOOL_T);
+    node->first_avail = node->endp = (char *)node + SIZEOF_MEMNODE_T;
+    MEM_POISON(node->endp, MEMPOOL_ALIGNMENT);
+    node->next = node;
+    node->ref = &node->next;
+    node->index = node->free_index = node->epoch = 0;
+    node->map_size = 0;
+    node->zero_from = node->endp;
+    node->left = node->right = NULL;
+
+    pool->self_first_avail = node->first_avail;
+    pool->allocator = parent->allocator;
+    pool->active = pool->self = node;
+    pool->child = pool->lazy_child = NULL;
+    pool->parent = parent;
+    pool->serial = node->serial = 0;
+    pool->cleanups = pool->free_cleanups = NULL;
+    pool->usage = pool->held = pool->limit = 0;
+    pool->abort_fn = parent->abort_fn;
+    pool->retain = pool->retain_peak = pool->held_peak = 0;
+    pool->retain_adaptive = false;
+    pool->lazy = true;
+    pool->parent_serial = parent->serial;
+#ifdef HAS_THREADS
+    pool->mutex = NULL;
+#endif
+    pool_stats_init(pool);
+
+    /* Only the thread allocating from the parent gets here, the list
+     * needs no lock.
+     */
+    if ((pool->sibling = parent->lazy_child) != NULL)
+        pool->sibling->ref = &pool->sibling;
+    parent->lazy_child = pool;
+    pool->ref = &parent->lazy_child;
+
+    *newpool = pool;
+    return true;
+}
+
+
+static void mempool_retain_nodes(mempool_t *pool);
+
+void mempool_clear(mempool_t *pool)
+{
+    memnode_t    *active;
+
+    /* Destroy the subpools.  The subpools will detach themselves from
+     * this pool thus this loop is safe and easy.
+     */
+    while (pool->child) {
+        mempool_destroy(pool->child);
+    }
+    while (pool->lazy_child) {
+        mempool_destroy(pool->lazy_child);
+    }
+
+    /* Run the cleanups, their memory goes with the nodes below */
+    cleanups_run(pool, 0);
+    pool->free_cleanups = NULL;
+
+    /* Find the node attached to the pool structure, reset it, make
+     * it the active node and free the rest of the nodes, but for the
+     * ones to keep.
+     */
+    active = pool->active = pool->self;
+    node_dirty(active);
+    active->first_avail = pool->self_first_avail;
+    pool->serial = 0;
+    pool_stats_reset(pool);
+    MEM_POISON(active->first_avail, (size_t)(active->endp - active->first_avail));
+
+    if (pool->retain != 0) {
+        mempool_retain_nodes(pool);
+        return;
+    }
+    if (active->next == active)
+        return;
+
+    pool_usage_shrink(pool, pool->held - pool_self_size(pool));
+
+    *active->ref = NULL;
+    allocator_free(pool->allocator, active->next);
+    active->next = active;
+    active->ref = &active->next;
+}
+
+
+/* The first half of destroying a pool: its subpools and cleanups are
+ * gone and it is out of the tree, its nodes are left.
+ */
+static void mempool_detach(mempool_t *pool)
+{
+    /* Destroy the subpools.  The subpools will detach themselves from
+     * this pool thus this loop is safe and easy.
+     */
+    while (pool->child) {
+        mempool_destroy(pool->child);
+    }
+    while (pool->lazy_child) {
+        mempool_destroy(pool->lazy_child);
+    }
+
+    cleanups_run(pool, 0);
+    pool_usage_shrink(pool, pool->held);
+
+    /* Remove the pool from the parents child list, the list of lazy
+     * subpools is only touched by the thread owning the parent.
+     */
+    if (pool->lazy) {
+        if ((*pool->ref = pool->sibling) != NULL)
+            pool->sibling->ref = pool->ref;
+    }
+    else if (pool->parent) {
+#ifdef HAS_THREADS
+        mutex_t *mutex;
+        if ((mutex = pool->parent->allocator->mutex) != NULL)
+            mutex_lock(mutex);
+#endif /* HAS_THREADS */
+
+        if ((*pool->ref = pool->sibling) != NULL)
+            pool->sibling->ref = pool->ref;
+
+#ifdef HAS_THREADS
+        if (mutex)
+            mutex_unlock(mutex);
+#endif /* HAS_THREADS */
+    }
+
+#ifdef HAS_THREADS
+    if (pool->mutex != NULL) {
+        mutex_destroy(pool->mutex);
+        free(pool->mutex);
+        pool->mutex = NULL;
+    }
+#endif /* HAS_THREADS */
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+    memnode_t    *active;
+    allocator_t    *allocator;
+
+    mempool_detach(pool);
+    
+    /* Find the block attached to the pool structure.  Save a copy of the
+     * allocator pointer, because the pool struct soon will be no more.
+     */
+    allocator = pool->allocator;
+    active = pool->self;
+    if (pool->lazy) {
+        /* The structure stays in the parent, only the nodes go */
+        if (active->next != active) {
+            *active->ref = NULL;
+            allocator_free(allocator, active->next);
+        }
+        return;
+    }
+    *active->ref = NULL;
+
+#ifdef HAS_THREADS
+    if (allocator->owner == pool) {
+        /* Make sure to remove the lock, since it is highly likely to
+         * be invalid now.
+         */
+        allocator_reclaimer_stop(allocator);
+        allocator->mutex = NULL;
+    }
+#endif /* HAS_THREADS */
+
+    /* Free all the nodes in the pool (including the node holding the
+     * pool struct), by giving them back to the allocator.
+     */
+    allocator_free(allocator, active);
+
+    /* If this pool happens to be the owner of the allocator, free
+     * everything in the allocator (that includes the pool struct
+     * and the allocator).  Don't worry about destroying the optional mutex
+     * in the allocator, it will have been destroyed by the cleanup function.
+     */
+    if (allocator->owner == pool) {
+        allocator_destroy(allocator);
+    }
+}
+
+bool mempool_handoff(mempool_t *pool)
+{
+    mempool_shm_t  *shm = pool->allocator->shm;
+    memnode_t      *self = pool->self, *node, *next;
+    char           *self_first_avail = pool->self_first_avail;
+    shm_node_t     *header;
+
+    /* The owner of the allocator would take the segment with it, and
+     * the structure of a lazy pool is not in its nodes.
+     */
+    if (shm == NULL || pool->allocator->owner == pool || pool->lazy) {
+        return false;
+    }
+    mempool_detach(pool);
+
+    /* Write the links and the allocated bytes of every node into its
+     * shared header, for the node holding the pool structure the bytes
+     * behind it.  The push publishes them.
+     */
+    *self->ref = NULL;
+    for (node = self; node != NULL; node = next) {
+        next = node->next;
+        header = shm_node(node);
+        header->begin = shm_offset(shm, node == self
+            ? self_first_avail : (char *)node + SIZEOF_MEMNODE_T);
+        header->end = shm_offset(shm, node->first_avail);
+        header->next = next != NULL ? shm_offset(shm, shm_node(next)) : 0;
+    }
+    header = shm_node(self);
+    shm_push(&shm->segment->handed, shm_offset(shm, header), &header->batch);
+
+    return true;
+}
+
+bool mempool_shm_open(mempool_shm_t **shm, const char *name)
+{
+    mempool_shm_t  *new_shm;
+    unsigned int   magic;
+
+    *shm = NULL;
+    if ((new_shm = shm_map(name, 0)) == NULL) {
+        return false;
+    }
+#ifdef _WIN32
+    magic = (unsigned int)InterlockedCompareExchange(
+        (volatile LONG *)&new_shm->segment->magic, 0, 0);
+#else
+    magic = __atomic_load_n(&new_shm->segment->magic, __ATOMIC_ACQUIRE);
+#endif
+    if (magic != SHM_MAGIC) {
+        shm_unmap(new_shm);
+        return false;
+    }
+    *shm = new_shm;
+    return true;
+}
+
+void mempool_shm_close(mempool_shm_t *shm)
+{
+    shm_unmap(shm);
+}
+
+memnode_t *mempool_shm_receive(mempool_shm_t *shm)
+{
+    shm_node_t     *header;
+    size_t         offset, next;
+
+    /* The handed off batches are a stack, take it as a whole and keep
+     * it the other way round.
+     */
+    if (shm->pending == 0) {
+        for (offset = shm_exchange(&shm->segment->handed, 0); offset != 0; offset = next) {
+            if ((header = shm_node_at(shm, offset)) == NULL) {
+                break;
+            }
+            next = header->batch;
+            header->batch = shm->pending;
+            shm->pending = offset;
+        }
+    }
+    if ((header = shm_node_at(shm, shm->pending)) == NULL) {
+        shm->pending = 0;
+        return NULL;
+    }
+    shm->pending = header->batch;
+    return shm_memnode(header);
+}
+
+memnode_t *mempool_shm_next(mempool_shm_t *shm, memnode_t *node)
+{
+    shm_node_t     *header;
+
+    if ((header = shm_node_at(shm, shm_node(node)->next)) == NULL) {
+        return NULL;
+    }
+    return shm_memnode(header);
+}
+
+void *mempool_shm_data(mempool_shm_t *shm, memnode_t *node, size_t *size)
+{
+    shm_node_t     *header = shm_node(node);
+    size_t         begin = header->begin, end = header->end;
+
+    if (begin > end || end > shm->size) {
+        *size = 0;
+        return NULL;
+    }
+    *size = end - begin;
+    return shm_ptr(shm, begin);
+}
+
+void mempool_shm_return(mempool_shm_t *shm, memnode_t *batch)
+{
+    shm_node_t     *header = shm_node(batch);
+
+    shm_push(&shm->segment->returned, shm_offset(shm, header), &header->batch);
+}
+
+void mempool_limit_set(mempool_t *pool, size_t limit_bytes)
+{
+    /* The usage stops below g_pool, a limit on it would never be hit. */
+    if (pool == NULL || pool == g_pool) {
+        return;
+    }
+    counter_set(&pool->limit, limit_bytes);
+}
+
+size_t mempool_usage(mempool_t *pool)
+{
+    return counter_read(&pool->usage);
+}
+
+void mempool_abort_set(mempool_t *pool, mempool_abort_fn abort_fn)
+{
+    pool->abort_fn = abort_fn;
+}
+
+void mempool_retain_set(mempool_t *pool, size_t max_bytes, bool adaptive)
+{
+#ifdef POOL_GUARD_PROTECT_FREED
+    /* Blocks of the last round must still trap */
+    max_bytes = 0;
+#endif //POOL_GUARD_PROTECT_FREED
+    pool->retain = max_bytes;
+    pool->retain_adaptive = adaptive;
+    pool->retain_peak = 0;
+    pool->held_peak = pool->held;
+}
+
+
+/* Node list management helper macros; list_insert() inserts 'node'
+ * before 'point'. */
+#define list_insert(node, point) do {           \
+    node->ref = point->ref;                     \
+    *node->ref = node;                          \
+    node->next = point;                         \
+    point->ref = &node->next;                   \
+} while (0)
+
+/* list_remove() removes 'node' from its list. */
+#define list_remove(node) do {                  \
+    *node->ref = node->next;                    \
+    node->next->ref = node->ref;                \
+} while (0)
+
+/* Returns the amount of free space in the given node. */
+#define node_free_space(node_) ((size_t)(node_->endp - node_->first_avail))
+
+/* Returns the number of whole boundary sized blocks free in the node,
+ * the key the node list is ordered by. */
+#define node_free_index(node_, boundary_index) \
+    ((ALIGN(node_free_space(node_) + 1, (size_t)1 << (boundary_index)) \
+      - ((size_t)1 << (boundary_index))) >> (boundary_index))
+
+/* File a node that is not the active one behind it, by free_index. */
+static void list_insert_sorted(mempool_t *pool, memnode_t *node)
+{
+    memnode_t    *point;
+
+    node->free_index = node_free_index(node, pool->allocator->boundary_index);
+    for (point = pool->active->next; point != pool->active; point = point->next) {
+        if (node->free_index >= point->free_index)
+            break;
+    }
+    list_insert(node, point);
+}
+
+/* mempool_clear() of a pool that keeps nodes, the node holding the pool
+ * is already reset.  The other nodes are reset in place and filed
+ * behind it while they fit into the budget, the rest is freed.
+ */
+static void mempool_retain_nodes(mempool_t *pool)
+{
+    memnode_t    *active, *node, *next, *freelist = NULL;
+    size_t       keep, needed, untouched = 0, freed = 0;
+
+    /* Nodes kept over the last clear and not carved from since were not
+     * needed in this round.
+     */
+    active = pool->active;
+    for (node = active->next; node != active; node = node->next) {
+        if (node->first_avail == (char *)node + SIZEOF_MEMNODE_T)
+            untouched += node_size(node);
+    }
+    needed = pool->held_peak - pool_self_size(pool) - untouched;
+
+    keep = pool->retain;
+    if (pool->retain_adaptive) {
+        if (needed >= pool->retain_peak)
+            pool->retain_peak = needed;
+        else
+            pool->retain_peak -= (pool->retain_peak - needed + 7) / 8;
+        if (keep > pool->retain_peak)
+            keep = pool->retain_peak;
+    }
+
+    node = active->next;
+    active->next = active;
+    active->ref = &active->next;
+    while (node != active) {
+        next = node->next;
+        if (node_size(node) <= keep) {
+            keep -= node_size(node);
+            node_dirty(node);
+            node->first_avail = (char *)node + SIZEOF_MEMNODE_T;
+            node->serial = 0;
+            MEM_POISON(node->first_avail, node_free_space(node));
+            list_insert_sorted(pool, node);
+            pool_stats_node(pool, node);
+        }
+        else {
+            freed += node_size(node);
+            node->next = freelist;
+            freelist = node;
+        }
+        node = next;
+    }
+
+    if (freelist != NULL) {
+        pool_usage_shrink(pool, freed);
+        allocator_free(pool->allocator, freelist);
+    }
+    pool->held_peak = pool->held;
+}
+
+
+/* Make a node with at least 'size' bytes free the active node, either
+ * the next one in the list or a new one, and move the previously active
+ * node to its place in the list.
+ */
+static memnode_t *mempool_node_activate(mempool_t *pool, size_t size)
+{
+    memnode_t *active, *node;
+    size_t free_index, boundary_index;
+
+    active = pool->active;
+    node = active->next;
+    /* A node from before the latest mark is not reused, a rewind could
+     * not tell which part of it to give back.
+     */
+    if (size <= node_free_space(node) && node->serial == pool->serial) {
+        list_remove(node);
+    }
+    else if ((node = allocator_alloc(pool->allocator, size)) == NULL) {
+        pool_abort(pool, size);
+        return NULL;       
+    }
+    else if (!pool_usage_grow(pool, node_size(node))) {
+        allocator_free(pool->allocator, node);
+        pool_abort(pool, size);
+        return NULL;
+    }
+    else {
+        node->serial = pool->serial;
+        pool_stats_node(pool, node);
+        MEM_POISON(node->first_avail, node_free_space(node));
+    }
+
+    node->free_index = 0;
+
+    list_insert(node, active);
+
+    pool->active = node;
+
+    boundary_index = pool->allocator->boundary_index;
+    free_index = node_free_index(active, boundary_index);
+
+    active->free_index = free_index;
+    node = active->next;
+    if (free_index >= node->free_index)
+        return pool->active;
+    do {
+        node = node->next;
+    }
+    while (free_index < node->free_index);
+
+    list_remove(active);
+    list_insert(active, node);
+
+    return pool->active;
+}
+
+void *mempool_alloc(mempool_t *pool, size_t in_size)
+{
+    memnode_t *active;
+    void *mem;
+    size_t size;
+
+    size = ALIGN_DEFAULT(in_size);
+    if (size < in_size) {
+        return NULL;
+    }
+    active = pool->active;
+
+#ifdef POOL_GUARD_FLUSH
+    /* The block goes against the end of the node, right before the guard
+     * page; the rest of the node is given up so the next block takes
+     * another one.  Nodes of a segment have no guard, and their bytes
+     * are handed off as they were allocated.
+     */
+    if (pool->allocator->shm == NULL) {
+        if (size > node_free_space(active)
+            && (active = mempool_node_activate(pool, size)) == NULL) {
+            return NULL;
+        }
+        mem = active->endp - size;
+        active->first_avail = active->endp;
+        pool_stats_alloc(pool, in_size, size);
+        MEM_UNPOISON(mem, in_size);
+
+        return mem;
+    }
+#endif //POOL_GUARD_FLUSH
+
+    /* If the active node has enough bytes left, use it. */
+    if (size <= node_free_space(active)) {
+        mem = active->first_avail;
+        active->first_avail += size;
+        pool_stats_alloc(pool, in_size, size);
+        MEM_UNPOISON(mem, in_size);
+
+        return mem;
+    }
+
+    if ((active = mempool_node_activate(pool, size)) == NULL) {
+        return NULL;
+    }
+    pool_stats_alloc(pool, in_size, size);
+
+    mem = active->first_avail;
+    active->first_avail += size;
+    MEM_UNPOISON(mem, in_size);
+
+    return mem;
+}
+
+void *mempool_alloc_spill(mempool_t *pool, size_t in_size)
+{
+    return mempool_alloc(pool, in_size);
+}
+
+bool mempool_alloc_many(mempool_t *pool, size_t in_size, size_t count, void **out)
+{
+    memnode_t *active;
+    char *mem;
+    size_t size, n, i;
+
+    size = ALIGN_DEFAULT(in_size);
+    if (size < in_size) {
+        return false;
+    }
+    active = pool->active;
+
+#ifdef POOL_GUARD_FLUSH
+    /* Every block against a guard page, as mempool_alloc() puts it */
+    if (pool->allocator->shm == NULL) {
+        for (; count != 0; count--) {
+            if ((*out++ = mempool_alloc(pool, in_size)) == NULL) {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif //POOL_GUARD_FLUSH
+
+    while (count != 0) {
+        /* Carve as many as fit out of the active node at once */
+        n = size != 0 ? node_free_space(active) / size : count;
+        if (n > count)
+            n = count;
+        mem = active->first_avail;
+        for (i = 0; i < n; i++) {
+            out[i] = mem;
+            MEM_UNPOISON(mem, in_size);
+            mem += size;
+        }
+        active->first_avail = mem;
+        pool_stats_alloc(pool, in_size * n, size * n);
+        out += n;
+        if ((count -= n) == 0) {
+            break;
+        }
+
+        /* Get a node for the rest, but no larger than the largest one the
+         * allocator keeps in its buckets, or for one more block if that
+         * is larger.  A huge count then takes node after node of a size
+         * the allocator recycles, instead of one node the sink holds on
+         * to, or none at all.
+         */
+        n = ((size_t)pool->allocator->max_index << pool->allocator->boundary_index)
+            - SIZEOF_MEMNODE_T;
+        if (count <= n / size)
+            n = count * size;
+        else if (n < size)
+            n = size;
+        if ((active = mempool_node_activate(pool, n)) == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void *mempool_alloc_array(mempool_t *pool, size_t in_size, size_t count)
+{
+    size_t size = ALIGN_DEFAULT(in_size);
+
+    if (size < in_size || (count != 0 && size > (size_t)-1 / count)) {
+        return NULL;
+    }
+    return mempool_alloc(pool, size * count);
+}
+
+/* Blocks of at least this many bytes are zeroed with non-temporal
+ * stores, which do not pull them through the cache and push out what
+ * is being worked on.  Smaller ones still fit in the cache, where
+ * memset() is faster.
+ */
+#ifndef POOL_ZERO_STREAM_MIN
+#define POOL_ZERO_STREAM_MIN    ((size_t)8 << 20)
+#endif
+
+static void mem_zero(char *mem, size_t size)
+{
+#ifdef HAS_SSE2
+    if (size >= POOL_ZERO_STREAM_MIN) {
+        __m128i    zero = _mm_setzero_si128();
+        char       *end = mem + size, *p = (char *)ALIGN((size_t)mem, 16);
+
+        memset(mem, 0, (size_t)(p - mem));
+        for (; (size_t)(end - p) >= 64; p += 64) {
+            _mm_stream_si128((__m128i *)p, zero);
+            _mm_stream_si128((__m128i *)(p + 16), zero);
+            _mm_stream_si128((__m128i *)(p + 32), zero);
+            _mm_stream_si128((__m128i *)(p + 48), zero);
+        }
+        _mm_sfence();
+        memset(p, 0, (size_t)(end - p));
+        return;
+    }
+#endif //HAS_SSE2
+    memset(mem, 0, size);
+}
+
+/* Zero the block at mem the pool just handed out, but for the part of
+ * it that the active node still knows to be zero.
+ */
+static void block_zero(mempool_t *pool, char *mem, size_t size)
+{
+    memnode_t    *active = pool->active;
+
+    if (mem >= (char *)active + SIZEOF_MEMNODE_T && mem <= active->endp
+        && size > 0 && mem + size > active->zero_from) {
+        size = mem < active->zero_from ? (size_t)(active->zero_from - mem) : 0;
+    }
+    mem_zero(mem, size);
+}
+
+void *mempool_calloc(mempool_t *pool, size_t in_size)
+{
+    void *mem;
+
+    mem = mempool_alloc(pool, in_size);
+    if (mem != NULL) {
+        block_zero(pool, (char *)mem, in_size);
+    }
+
+    return mem;
+}
+
+/* Bytes an arena claims from its pool at a time */
+#define ARENA_CHUNK_SIZE    4096
+/* Boundary sized blocks a concurrent pool gets a node of at least when
+ * it spills, so that the lock is rarely taken and arena chunks do not
+ * leave half the node behind.
+ */
+#define CONCURRENT_NODE_BOUNDARIES  16
 
-    pool = (mempool_t *)node->first_avail;
-    node->first_avail = pool->self_first_avail = (char *)pool + SIZEOF_MEMPOOL_T;
-    
-    pool->allocator = allocator;
-    pool->active = pool->self = node;
-    pool->child = NULL;
-    pool->parent = NULL;
-    pool->sibling = NULL;
-    pool->ref = NULL;
-    
-    if ((pool->parent = parent) != NULL) {
 #ifdef HAS_THREADS
-        mutex_t *mutex;
-        if ((mutex = parent->allocator->mutex) != NULL) {
-            mutex_lock(mutex);
+/* The active node of a concurrent pool and its first_avail are read and
+ * claimed outside the pool's lock.
+ */
+#ifdef _WIN32
+#define pointer_read(mem) \
+    InterlockedCompareExchangePointer((PVOID volatile *)(mem), NULL, NULL)
+#define pointer_set(mem, value) \
+    ((void)InterlockedExchangePointer((PVOID volatile *)(mem), (value)))
+#define pointer_cas(mem, cmp, with) \
+    (InterlockedCompareExchangePointer((PVOID volatile *)(mem), (with), (cmp)) == (cmp))
+#else
+#define pointer_read(mem)           __atomic_load_n((mem), __ATOMIC_ACQUIRE)
+#define pointer_set(mem, value)     __atomic_store_n((mem), (value), __ATOMIC_RELEASE)
+#define pointer_cas(mem, cmp, with) \
+    __sync_bool_compare_and_swap((mem), (cmp), (with))
+#endif
+
+#ifdef HAS_STATS
+#define pool_stats_alloc_shared(pool, in_size, size) do {       \
+    stats_add(&(pool)->stats.bytes_requested, in_size);         \
+    stats_add(&(pool)->stats.bytes_allocated, size);            \
+    stats_add(&(pool)->stats.bytes_wasted, size - in_size);     \
+} while (0)
+#else
+#define pool_stats_alloc_shared(pool, in_size, size)    ((void)(in_size))
+#endif //HAS_STATS
+
+/* Claim 'size' bytes of the node with a CAS on its first_avail, NULL
+ * when they do not fit.
+ */
+static char *node_claim(memnode_t *node, size_t size)
+{
+    char    *mem;
+
+    do {
+        mem = (char *)pointer_read(&node->first_avail);
+        if (size > (size_t)(node->endp - mem)) {
+            return NULL;
+        }
+    } while (!pointer_cas(&node->first_avail, mem, mem + size));
+
+    return mem;
+}
+
+/* The active node of a concurrent pool is out of room: with the lock
+ * held, get a node for the block.  When the new node keeps more room
+ * than the active one it becomes the active node, and the old one is
+ * sealed, its tail given up, so that nobody claims from it any more
+ * once it is filed by its free space.  Otherwise it goes behind.
+ */
+static void *mempool_spill_concurrent(mempool_t *pool, size_t in_size, size_t size)
+{
+    memnode_t    *active, *node;
+    char         *mem;
+    size_t       min_size;
+
+    mutex_lock(pool->mutex);
+
+    /* Another thread may have spilled meanwhile */
+    active = pool->active;
+    if ((mem = node_claim(active, size)) != NULL) {
+        mutex_unlock(pool->mutex);
+        pool_stats_alloc_shared(pool, in_size, size);
+        MEM_UNPOISON(mem, in_size);
+        return mem;
+    }
+
+    /* Nobody claims from the nodes behind the active one, the first may
+     * be one kept over the last clear.
+     */
+    node = active->next;
+    if (node != active && size <= node_free_space(node) && node->serial == pool->serial) {
+        list_remove(node);
+    }
+    else {
+        min_size = ((size_t)CONCURRENT_NODE_BOUNDARIES << pool->allocator->boundary_index)
+            - SIZEOF_MEMNODE_T;
+        if ((node = allocator_alloc(pool->allocator, size > min_size ? size : min_size)) == NULL) {
+            mutex_unlock(pool->mutex);
+            pool_abort(pool, size);
+            return NULL;
+        }
+        if (!pool_usage_grow(pool, node_size(node))) {
+            mutex_unlock(pool->mutex);
+            allocator_free(pool->allocator, node);
+            pool_abort(pool, size);
+            return NULL;
+        }
+        node->serial = pool->serial;
+        pool_stats_node(pool, node);
+        MEM_POISON(node->first_avail, node_free_space(node));
+    }
+    mem = node->first_avail;
+    node->first_avail += size;
+
+    if (node_free_space(node) <= (size_t)(active->endp - (char *)pointer_read(&active->first_avail))) {
+        list_insert_sorted(pool, node);
+    }
+    else {
+        /* A claim that got in first still stands */
+        pointer_set(&active->first_avail, active->endp);
+        active->free_index = 0;
+        list_insert(node, active);
+        /* Full, it goes last, that is right in front of the new one */
+        list_remove(active);
+        list_insert(active, node);
+        pointer_set(&pool->active, node);
+    }
+
+    mutex_unlock(pool->mutex);
+    pool_stats_alloc_shared(pool, in_size, size);
+    MEM_UNPOISON(mem, in_size);
+
+    return mem;
+}
+#endif //HAS_THREADS
+
+bool mempool_concurrent_enable(mempool_t *pool)
+{
+#ifdef HAS_THREADS
+    if (pool->mutex != NULL) {
+        return true;
+    }
+    if ((pool->mutex = (mutex_t *)malloc(sizeof(mutex_t))) == NULL) {
+        return false;
+    }
+    mutex_init(pool->mutex);
+    return true;
+#else
+    (void)pool;
+    return false;
+#endif //HAS_THREADS
+}
+
+void *mempool_alloc_concurrent(mempool_t *pool, size_t in_size)
+{
+#ifdef HAS_THREADS
+    char    *mem;
+    size_t  size;
+
+    if (pool->mutex == NULL) {
+        return mempool_alloc(pool, in_size);
+    }
+    size = ALIGN_DEFAULT(in_size);
+    if (size < in_size) {
+        return NULL;
+    }
+
+    mem = node_claim((memnode_t *)pointer_read(&pool->active), size);
+    if (mem == NULL) {
+        return mempool_spill_concurrent(pool, in_size, size);
+    }
+    pool_stats_alloc_shared(pool, in_size, size);
+    MEM_UNPOISON(mem, in_size);
+
+    return mem;
+#else
+    return mempool_alloc(pool, in_size);
+#endif //HAS_THREADS
+}
+
+void mempool_arena_init(mempool_arena_t *arena, mempool_t *pool)
+{
+    arena->pool = pool;
+    arena->first_avail = arena->endp = NULL;
+}
+
+void *mempool_arena_alloc(mempool_arena_t *arena, size_t in_size)
+{
+    char    *mem;
+    size_t  size;
+
+    size = ALIGN_DEFAULT(in_size);
+    if (size < in_size) {
+        return NULL;
+    }
+    if (size > (size_t)(arena->endp - arena->first_avail)) {
+        /* Large blocks do not waste a chunk */
+        if (size > ARENA_CHUNK_SIZE / 4) {
+            return mempool_alloc_concurrent(arena->pool, in_size);
+        }
+        mem = (char *)mempool_alloc_concurrent(arena->pool, ARENA_CHUNK_SIZE);
+        if (mem == NULL) {
+            return NULL;
+        }
+        MEM_POISON(mem, ARENA_CHUNK_SIZE);
+        arena->first_avail = mem;
+        arena->endp = mem + ARENA_CHUNK_SIZE;
+    }
+
+    mem = arena->first_avail;
+    arena->first_avail += size;
+    MEM_UNPOISON(mem, in_size);
+
+    return mem;
+}
+
+void mempool_mark(mempool_t *pool, mempool_mark_t *mark)
+{
+    mark->node = pool->active;
+    mark->first_avail = pool->active->first_avail;
+    mark->serial = ++pool->serial;
+}
+
+void mempool_rewind(mempool_t *pool, const mempool_mark_t *mark)
+{
+    memnode_t *active, *node, *next, *first = NULL, *freelist = NULL;
+    size_t freed = 0;
+
+    /* The lazy subpools whose structure was allocated since the mark go
+     * first.  They are linked latest first, and the ones from after an
+     * earlier rewind were destroyed by it, so they lead the list.
+     */
+    while (pool->lazy_child != NULL && pool->lazy_child->parent_serial >= mark->serial) {
+        mempool_destroy(pool->lazy_child);
+    }
+
+    /* Walk the list in its order, from the node after the active one
+     * round to the active one, and unlink the nodes got since the mark.
+     * All of them came after it, the mark's node is the only older one
+     * that may have been carved from since.
+     */
+    active = pool->active;
+    node = active->next;
+    for (;;) {
+        next = node->next;
+        if (node != mark->node && node->serial >= mark->serial) {
+            list_remove(node);
+            pool_stats_unnode(pool, node);
+            freed += node_size(node);
+            node->next = freelist;
+            freelist = node;
+        }
+        else if (first == NULL && node != mark->node) {
+            first = node;
+        }
+        if (node == active) {
+            break;
         }
-#endif /* HAS_THREADS */
-
-        if ((pool->sibling = parent->child) != NULL)
-            pool->sibling->ref = &pool->sibling;
+        node = next;
+    }
 
-        parent->child = pool;
-        pool->ref = &parent->child;
+    /* The rest is still ordered starting at 'first', put the mark's node
+     * in front of it as the active node again.
+     */
+    /* The cleanups registered since the mark go first, they may still
+     * use memory from those nodes.  Killed cleanups may sit in memory
+     * about to be rewound, they are not reused any more.
+     */
+    cleanups_run(pool, mark->serial);
+    pool->free_cleanups = NULL;
 
-#ifdef HAS_THREADS
-        if (mutex)
-            mutex_unlock(mutex);
-#endif /* HAS_THREADS */
+    node = mark->node;
+    if (first != NULL && node->next != first) {
+        list_remove(node);
+        list_insert(node, first);
     }
-    else {
-        pool->sibling = NULL;
-        pool->ref = NULL;
+    node->free_index = 0;
+    node_dirty(node);
+    node->first_avail = mark->first_avail;
+    MEM_POISON(node->first_avail, node_free_space(node));
+    pool->active = node;
+    pool->serial = mark->serial - 1;
+
+    if (freelist != NULL) {
+        pool_usage_shrink(pool, freed);
+        allocator_free(pool->allocator, freelist);
     }
-    
-    *newpool = pool;
-    return true;
 }
 
-
-bool mempool_create_unmanaged(mempool_t **newpool, allocator_t *allocator)
+bool mempool_cleanup_register(mempool_t *pool, void *data, void (*cleanup)(void *data))
 {
-    mempool_t    *pool;
-    memnode_t    *node;
-    allocator_t    *pool_allocator;
+    mempool_cleanup_t *c;
 
-    *newpool = NULL;
-
-    if ((pool_allocator = allocator) == NULL) {
-        if (!allocator_create(&pool_allocator)) {
-            return false;
-        }
+    if ((c = pool->free_cleanups) != NULL) {
+        pool->free_cleanups = c->next;
     }
-    if ((node = allocator_alloc(pool_allocator, 
-        MIN_ALLOC - SIZEOF_MEMNODE_T)) == NULL) {
+    else if ((c = (mempool_cleanup_t *)mempool_alloc(pool, sizeof(*c))) == NULL) {
         return false;
     }
+    c->data = data;
+    c->cleanup = cleanup;
+    c->serial = pool->serial;
+    c->next = pool->cleanups;
+    pool->cleanups = c;
 
-    node->next = node;
-    node->ref = &node->next;
+    return true;
+}
 
-    pool = (mempool_t *)node->first_avail;
-    node->first_avail = pool->self_first_avail = (char *)pool + SIZEOF_MEMPOOL_T;
-    
-    pool->allocator = pool_allocator;
-    pool->active = pool->self = node;
-    pool->child = NULL;
-    pool->parent = NULL;
-    pool->sibling = NULL;
-    pool->ref = NULL;
-    
-    if (!allocator) {
-        pool_allocator->owner = pool;
+bool mempool_cleanup_kill(mempool_t *pool, void *data, void (*cleanup)(void *data))
+{
+    mempool_cleanup_t *c, **ref;
+
+    for (ref = &pool->cleanups; (c = *ref) != NULL; ref = &c->next) {
+        if (c->data == data && c->cleanup == cleanup) {
+            *ref = c->next;
+            c->next = pool->free_cleanups;
+            pool->free_cleanups = c;
+            return true;
+        }
     }
-    *newpool = pool;
 
-    return true;
+    return false;
 }
 
+void mempool_cleanup_run(mempool_t *pool, void *data, void (*cleanup)(void *data))
+{
+    mempool_cleanup_kill(pool, data, cleanup);
+    cleanup(data);
+}
 
-void mempool_clear(mempool_t *pool)
+void *mempool_realloc(mempool_t *pool, void *ptr, size_t old_size, size_t new_size)
 {
-    memnode_t    *active;
+    memnode_t *active;
+    void *mem;
+    size_t old_aligned, new_aligned;
 
-    /* Destroy the subpools.  The subpools will detach themselves from
-     * this pool thus this loop is safe and easy.
-     */
-    while (pool->child) {
-        mempool_destroy(pool->child);
+    if (ptr == NULL) {
+        return mempool_alloc(pool, new_size);
+    }
+    old_aligned = ALIGN_DEFAULT(old_size);
+    new_aligned = ALIGN_DEFAULT(new_size);
+    if (new_aligned < new_size) {
+        return NULL;
     }
+    active = pool->active;
 
-    /* Find the node attached to the pool structure, reset it, make
-     * it the active node and free the rest of the nodes.
-     */
-    active = pool->active = pool->self;
-    active->first_avail = pool->self_first_avail;
+    if ((char *)ptr + old_aligned == active->first_avail) {
+        /* The last allocation of the active node, move its end */
+        node_dirty(active);
+        if (new_aligned <= old_aligned
+            || new_aligned - old_aligned <= node_free_space(active)) {
+            active->first_avail = (char *)ptr + new_aligned;
+            pool_stats_alloc(pool, new_size - old_size, new_aligned - old_aligned);
+            MEM_POISON(ptr, (size_t)(active->endp - (char *)ptr));
+            MEM_UNPOISON(ptr, new_size);
+            return ptr;
+        }
 
-    if (active->next == active)
-        return;
+        /* Give the bytes back to the node before moving out, they count
+         * towards its free_index then.  The spill below won't touch
+         * this node, so they are still there to be copied.
+         */
+        active->first_avail = (char *)ptr;
+        pool_stats_alloc(pool, 0 - old_size, 0 - old_aligned);
+        if ((mem = mempool_alloc(pool, new_size)) == NULL) {
+            active->first_avail = (char *)ptr + old_aligned;
+            pool_stats_alloc(pool, old_size, old_aligned);
+            return NULL;
+        }
+        memcpy(mem, ptr, old_size);
+        MEM_POISON(ptr, old_aligned);
+        return mem;
+    }
 
-    *active->ref = NULL;
-    allocator_free(pool->allocator, active->next);
-    active->next = active;
-    active->ref = &active->next;
+    if (new_size <= old_size) {
+        return ptr;
+    }
+    if ((mem = mempool_alloc(pool, new_size)) != NULL) {
+        memcpy(mem, ptr, old_size);
+    }
+    return mem;
 }
 
-
-void mempool_destroy(mempool_t *pool)
+size_t mempool_realloc_avail(mempool_t *pool, const void *ptr, size_t size)
 {
-    memnode_t    *active;
-    allocator_t    *allocator;
+    memnode_t *active = pool->active;
+    size_t aligned = ALIGN_DEFAULT(size);
 
-    /* Destroy the subpools.  The subpools will detach themselves from
-     * this pool thus this loop is safe and easy.
-     */
-    while (pool->child) {
-        mempool_destroy(pool->child);
+    if (ptr == NULL || (const char *)ptr + aligned != active->first_avail) {
+        return 0;
     }
+    return node_free_space(active) + (aligned - size);
+}
 
-    /* Remove the pool from the parents child list */
-    if (pool->parent) {
-#ifdef HAS_THREADS
-        mutex_t *mutex;
-        if ((mutex = pool->parent->allocator->mutex) != NULL)
-            mutex_lock(mutex);
-#endif /* HAS_THREADS */
+/* Objects per run, about a page worth of them */
+#define SLAB_RUN_BYTES      4096
+#define SLAB_RUN_MAX        64
 
-        if ((*pool->ref = pool->sibling) != NULL)
-            pool->sibling->ref = pool->ref;
+bool mempool_slab_create(mempool_slab_t **newslab, mempool_t *pool, size_t object_size)
+{
+    mempool_slab_t *slab;
+    size_t stride;
 
-#ifdef HAS_THREADS
-        if (mutex)
-            mutex_unlock(mutex);
-#endif /* HAS_THREADS */
+    *newslab = NULL;
+    stride = ALIGN_DEFAULT(object_size < sizeof(void *) ? sizeof(void *) : object_size);
+    if (stride < object_size) {
+        return false;
     }
-    
-    /* Find the block attached to the pool structure.  Save a copy of the
-     * allocator pointer, because the pool struct soon will be no more.
-     */
-    allocator = pool->allocator;
-    active = pool->self;
-    *active->ref = NULL;
-
-#ifdef HAS_THREADS
-    if (allocator->owner == pool) {
-        /* Make sure to remove the lock, since it is highly likely to
-         * be invalid now.
-         */
-        allocator->mutex = NULL;
+    if ((slab = (mempool_slab_t *)mempool_alloc(pool, sizeof(*slab))) == NULL) {
+        return false;
     }
-#endif /* HAS_THREADS */
+    slab->pool = pool;
+    slab->size = object_size;
+    slab->stride = stride;
+    slab->free = NULL;
+    slab->run = slab->run_end = NULL;
+    slab->serial = 0;
 
-    /* Free all the nodes in the pool (including the node holding the
-     * pool struct), by giving them back to the allocator.
-     */
-    allocator_free(allocator, active);
+    *newslab = slab;
+    return true;
+}
 
-    /* If this pool happens to be the owner of the allocator, free
-     * everything in the allocator (that includes the pool struct
-     * and the allocator).  Don't worry about destroying the optional mutex
-     * in the allocator, it will have been destroyed by the cleanup function.
-     */
-    if (allocator->owner == pool) {
-        allocator_destroy(allocator);
-    }
+/* The pool was rewound past memory the slab carved runs from, forget
+ * the runs and the freed objects, some of them are gone.
+ */
+static void slab_rewound(void *data)
+{
+    mempool_slab_t *slab = (mempool_slab_t *)data;
+
+    slab->free = NULL;
+    slab->run = slab->run_end = NULL;
+    slab->serial = 0;
 }
 
+void *mempool_slab_alloc(mempool_slab_t *slab)
+{
+    mempool_t *pool = slab->pool;
+    void *object;
+    size_t count;
 
-/* Node list management helper macros; list_insert() inserts 'node'
- * before 'point'. */
-#define list_insert(node, point) do {           \
-    node->ref = point->ref;                     \
-    *node->ref = node;                          \
-    node->next = point;                         \
-    point->ref = &node->next;                   \
-} while (0)
+    if ((object = slab->free) != NULL) {
+        slab->free = *(void **)object;
+        MEM_UNPOISON(object, slab->size);
+        return object;
+    }
 
-/* list_remove() removes 'node' from its list. */
-#define list_remove(node) do {                  \
-    *node->ref = node->next;                    \
-    node->next->ref = node->ref;                \
-} while (0)
+    if (slab->run == slab->run_end) {
+        /* A run carved under a mark must be dropped on its rewind */
+        if (pool->serial != 0 && pool->serial != slab->serial) {
+            if (!mempool_cleanup_register(pool, slab, slab_rewound)) {
+                return NULL;
+            }
+            slab->serial = pool->serial;
+        }
+        count = SLAB_RUN_BYTES / slab->stride;
+        if (count > SLAB_RUN_MAX)
+            count = SLAB_RUN_MAX;
+        if (count == 0)
+            count = 1;
+        if ((slab->run = (char *)mempool_alloc_array(pool, slab->stride, count)) == NULL) {
+            slab->run_end = NULL;
+            return NULL;
+        }
+        slab->run_end = slab->run + slab->stride * count;
+        MEM_POISON(slab->run, slab->stride * count);
+    }
 
-/* Returns the amount of free space in the given node. */
-#define node_free_space(node_) ((size_t)(node_->endp - node_->first_avail))
+    object = slab->run;
+    slab->run += slab->stride;
+    MEM_UNPOISON(object, slab->size);
+    return object;
+}
 
-void *mempool_alloc(mempool_t *pool, size_t in_size)
+void mempool_slab_free(mempool_slab_t *slab, void *object)
 {
-    memnode_t *active, *node;
-    void *mem;
-    size_t size, free_index;
+    if (object == NULL) {
+        return;
+    }
+    MEM_POISON(object, slab->stride);
+    MEM_UNPOISON(object, sizeof(void *));
+    *(void **)object = slab->free;
+    slab->free = object;
+}
+
+void *mempool_alloc_aligned(mempool_t *pool, size_t in_size, size_t alignment)
+{
+    memnode_t *active;
+    char *mem;
+    size_t size, pad;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= ALIGN_DEFAULT(1)) {
+        return mempool_alloc(pool, in_size);
+    }
 
     size = ALIGN_DEFAULT(in_size);
-    if (size < in_size) {
+    if (size < in_size || size + alignment < size) {
         return NULL;
     }
     active = pool->active;
 
-    /* If the active node has enough bytes left, use it. */
-    if (size <= node_free_space(active)) {
-        mem = active->first_avail;
-        active->first_avail += size;
+#ifdef POOL_GUARD_FLUSH
+    /* As in mempool_alloc(), the block ends as close to the guard page
+     * as the alignment lets it, the rest of the node is given up.
+     */
+    if (pool->allocator->shm == NULL) {
+        if (size > node_free_space(active)
+            || ((size_t)(active->endp - size) & ~(alignment - 1)) < (size_t)active->first_avail) {
+            if ((active = mempool_node_activate(pool,
+                size + alignment - ALIGN_DEFAULT(1))) == NULL) {
+                return NULL;
+            }
+        }
+        mem = (char *)((size_t)(active->endp - size) & ~(alignment - 1));
+        active->first_avail = active->endp;
+        pool_stats_alloc(pool, in_size, (size_t)(active->endp - mem));
+        MEM_UNPOISON(mem, in_size);
 
         return mem;
     }
+#endif //POOL_GUARD_FLUSH
 
-    node = active->next;
-    if (size <= node_free_space(node)) {
-        list_remove(node);
-    }
-    else if ((node = allocator_alloc(pool->allocator, size)) == NULL) {
-        return NULL;       
+    /* Pad up to the alignment inside the active node when it still fits,
+     * otherwise take a node that fits the worst case padding.  There is
+     * no threshold on the padding: a fresh node pads by as much on
+     * average, and the bytes after the block stay usable.  Either way
+     * the padding is consumed, so the free_index the node gets when it
+     * leaves the front of the list accounts for it.
+     */
+    pad = ALIGN((size_t)active->first_avail, alignment) - (size_t)active->first_avail;
+    if (pad + size > node_free_space(active)) {
+        if ((active = mempool_node_activate(pool,
+            size + alignment - ALIGN_DEFAULT(1))) == NULL) {
+            return NULL;
+        }
+        pad = ALIGN((size_t)active->first_avail, alignment) - (size_t)active->first_avail;
     }
+    pool_stats_alloc(pool, in_size, pad + size);
 
-    node->free_index = 0;
+    mem = active->first_avail + pad;
+    active->first_avail = mem + size;
+    MEM_UNPOISON(mem, in_size);
 
-    mem = node->first_avail;
-    node->first_avail += size;
+    return mem;
+}
 
-    list_insert(node, active);
+void *mempool_calloc_aligned(mempool_t *pool, size_t in_size, size_t alignment)
+{
+    void *mem;
 
-    pool->active = node;
+    mem = mempool_alloc_aligned(pool, in_size, alignment);
+    if (mem != NULL) {
+        block_zero(pool, (char *)mem, in_size);
+    }
 
-    free_index = (ALIGN(active->endp - active->first_avail + 1,
-                            BOUNDARY_SIZE) - BOUNDARY_SIZE) >> BOUNDARY_INDEX;
+    return mem;
+}
 
-    active->free_index = free_index;
-    node = active->next;
-    if (free_index >= node->free_index)
-        return mem;
-    do {
-        node = node->next;
+bool mempool_stats_get(mempool_t *pool, mempool_stats_t *stats)
+{
+#ifdef HAS_STATS
+    memnode_t    *node;
+
+    *stats = pool->stats;
+    /* Whatever is left behind the active node won't be handed out
+     * before it comes round again, count it as wasted too.
+     */
+    for (node = pool->active->next; node != pool->active; node = node->next) {
+        stats->bytes_wasted += node_free_space(node);
     }
-    while (free_index < node->free_index);
+    return true;
+#else
+    (void)pool;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif //HAS_STATS
+}
 
-    list_remove(active);
-    list_insert(active, node);
+static void mempool_stats_dump_tree(mempool_t *pool, FILE *out, int depth)
+{
+    mempool_stats_t    stats;
+    mempool_t          *child;
 
-    return mem;
+    mempool_stats_get(pool, &stats);
+    fprintf(out, "%*spool %p: nodes %lu (peak %lu), held %lu (peak %lu), "
+        "requested %lu, allocated %lu, wasted %lu\n",
+        depth * 2, "", (void *)pool,
+        (unsigned long)stats.nodes, (unsigned long)stats.nodes_peak,
+        (unsigned long)stats.bytes_held, (unsigned long)stats.bytes_held_peak,
+        (unsigned long)stats.bytes_requested, (unsigned long)stats.bytes_allocated,
+        (unsigned long)stats.bytes_wasted);
+
+    for (child = pool->child; child != NULL; child = child->sibling) {
+        mempool_stats_dump_tree(child, out, depth + 1);
+    }
+    for (child = pool->lazy_child; child != NULL; child = child->sibling) {
+        mempool_stats_dump_tree(child, out, depth + 1);
+    }
 }
 
-void *mempool_calloc(mempool_t *pool, size_t in_size)
+bool mempool_check(mempool_t *pool)
 {
-    void *mem;
+    memnode_t    *node, *active = pool->active;
+    mempool_t    *child;
+    size_t       boundary_index = pool->allocator->boundary_index;
+    size_t       held = 0, usage;
+    bool         has_self = false;
 
-    mem = mempool_alloc(pool, in_size);
-    if (mem != NULL) {
-        memset(mem, 0, in_size);
+    /* The ring is well linked, the active node comes first and the
+     * others follow by decreasing free space; their free_index is still
+     * the one computed when they left the front.
+     */
+    node = active;
+    do {
+        if (*node->ref != node || node->next->ref != &node->next) {
+            return false;
+        }
+        if (node->first_avail < (char *)node + SIZEOF_MEMNODE_T
+            || node->first_avail > node->endp
+            || node->zero_from < (char *)node + SIZEOF_MEMNODE_T
+            || node->zero_from > node->endp) {
+            return false;
+        }
+        if (node != active) {
+            if (node->free_index != node_free_index(node, boundary_index)) {
+                return false;
+            }
+            if (node->next != active && node->free_index < node->next->free_index) {
+                return false;
+            }
+        }
+        if (node->serial > pool->serial) {
+            return false;
+        }
+        if (node == pool->self) {
+            has_self = true;
+            held += pool_self_size(pool);
+        }
+        else {
+            held += node_size(node);
+        }
+        node = node->next;
+    } while (node != active);
+
+    if (!has_self || pool->self_first_avail > pool->self->endp
+        || (char *)pool + SIZEOF_MEMPOOL_T > pool->self_first_avail) {
+        return false;
     }
 
-    return mem;
+    /* The usage adds up the nodes of the subtree */
+    usage = held;
+    for (child = pool->child; child != NULL; child = child->sibling) {
+        if (child->parent != pool || *child->ref != child || child->lazy
+            || !mempool_check(child)) {
+            return false;
+        }
+        usage += child->usage;
+    }
+    /* The lazy subpools come latest first, by the mark they were made under */
+    for (child = pool->lazy_child; child != NULL; child = child->sibling) {
+        if (child->parent != pool || *child->ref != child || !child->lazy
+            || child->parent_serial > pool->serial
+            || (child->sibling != NULL && child->sibling->parent_serial > child->parent_serial)
+            || !mempool_check(child)) {
+            return false;
+        }
+        usage += child->usage;
+    }
+    return pool->held == held && (pool == g_pool || pool->usage == usage);
+}
+
+/* Print the counters of 'pool' and all its subpools.  The tree is walked
+ * without taking any lock, so nothing may create or destroy pools in it
+ * meanwhile.
+ */
+void mempool_stats_dump(mempool_t *pool, FILE *out)
+{
+    if (pool == NULL) {
+        pool = g_pool;
+    }
+    mempool_stats_dump_tree(pool, out, 0);
 }
 
 bool pool_initialize()
@@ -736,14 +4423,16 @@ bool pool_initialize()
         return false;
     }
 
-    g_allocator->max_free_index = 100;
+    allocator_max_free_set(g_allocator, 100 * BOUNDARY_SIZE);
     
 #ifdef HAS_THREADS
     mutex_t *mutex = (mutex_t*)mempool_alloc(g_pool, sizeof(mutex_t));
     mutex_init(mutex);
     g_allocator->mutex = mutex;
+    allocator_thread_cache_enable(g_allocator);
 #endif //HAS_THREADS
     g_allocator->owner = g_pool;
+    pools_initialized = true;
     return true;
 }
 
@@ -753,6 +4442,7 @@ void pool_terminate(void)
         return;
     }
 #ifdef HAS_THREADS
+    allocator_reclaimer_stop(g_allocator);
     if (g_allocator->mutex) {
         mutex_destroy(g_allocator->mutex);
         g_allocator->mutex = NULL;
@@ -761,4 +4451,5 @@ void pool_terminate(void)
     mempool_destroy(g_pool);
     g_pool = NULL;
     g_allocator = NULL;
+    pools_initialized = false;
 }
\ No newline at end of file
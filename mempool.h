@@ -10,27 +10,445 @@ Date   : 2013-06-25(Tue)
 #define _MEMPOOL_H_
 
 #include <stdlib.h>
+#include <stdio.h>
+#ifdef __cplusplus
+#include <new>
+#include <utility>
+#include <type_traits>
+#endif
 
 struct allocator_t;
 struct memnode_t;
 struct mempool_t;
+struct mempool_slab_t;
+struct mempool_shm_t;
+
+/* Alignment of every block but the ones of mempool_alloc_aligned() */
+#define MEMPOOL_ALIGNMENT   8
+
+/* Node geometry of an allocator, a field left 0 takes the default. */
+typedef struct allocator_options_t {
+    size_t          boundary_size;  /**< node granularity, a power of 2 (4 KiB) */
+    size_t          min_alloc;      /**< smallest node size (2 * boundary_size) */
+    unsigned int    max_index;      /**< exact-fit buckets, counting the sink (20) */
+    bool            numa_bind;      /**< place the nodes on numa_node (false) */
+    unsigned int    numa_node;      /**< memory node, @see allocator_numa_node() */
+    const char      *shm_name;      /**< shared memory segment to carve the nodes from (NULL) */
+    size_t          shm_size;       /**< bytes of that segment */
+} allocator_options_t;
+
+/* Allocator counters, only collected when built with HAS_STATS. */
+typedef struct allocator_stats_t {
+    size_t          sys_allocs;     /**< nodes obtained from the system */
+    size_t          sys_frees;      /**< nodes given back to the system */
+    size_t          bytes_sys;      /**< bytes currently held from the system */
+    size_t          bytes_cached;   /**< bytes sitting in the shared free lists */
+    size_t          bytes_released; /**< bytes given back to the system so far */
+    size_t          boundary_size;  /**< node granularity */
+    unsigned int    max_index;      /**< number of buckets, index 0 is the sink */
+} allocator_stats_t;
+
+/* Counters of one free list bucket, index 0 covers all oversized nodes. */
+typedef struct allocator_bucket_stats_t {
+    size_t          hits;           /**< requests served from the free lists */
+    size_t          misses;         /**< requests that went to the system */
+    size_t          nodes;          /**< nodes currently in the shared bucket */
+} allocator_bucket_stats_t;
+
+/* Pool counters, only collected when built with HAS_STATS. */
+typedef struct mempool_stats_t {
+    size_t          bytes_requested;    /**< bytes asked for since the last clear */
+    size_t          bytes_allocated;    /**< bytes handed out after alignment */
+    size_t          bytes_wasted;       /**< alignment and abandoned node tails */
+    size_t          bytes_held;         /**< size of the nodes owned by the pool */
+    size_t          bytes_held_peak;
+    size_t          nodes;              /**< nodes owned by the pool */
+    size_t          nodes_peak;
+} mempool_stats_t;
+
+/* Called with the pool and the size asked for when the pool cannot get a
+ * node, @see mempool_abort_set()
+ */
+typedef void (*mempool_abort_fn)(mempool_t *pool, size_t size);
+
+/* A thread's own sub-arena of a concurrent pool, @see mempool_arena_alloc() */
+typedef struct mempool_arena_t {
+    mempool_t       *pool;
+    char            *first_avail;
+    char            *endp;
+} mempool_arena_t;
+
+/* A savepoint of a pool, @see mempool_mark() */
+typedef struct mempool_mark_t {
+    memnode_t       *node;
+    char            *first_avail;
+    unsigned int    serial;
+} mempool_mark_t;
 
 bool        allocator_create(allocator_t **mem_allocator);
+bool        allocator_create_ex(allocator_t **mem_allocator, const allocator_options_t *options);
 void        allocator_destroy(allocator_t *mem_allocator);
 memnode_t   *allocator_alloc(allocator_t *mem_allocator, size_t in_size);
 void        allocator_free(allocator_t *mem_allocator, memnode_t *node);
 
+/* Nodes freed while in_size bytes are cached already go back to the
+ * system.  With ALLOCATOR_USES_LOCK_FREE a node of a bucket is unmapped
+ * only once the pops that started before it was freed are done; until
+ * then it is held outside the cache.  The nodes of the thread caches do
+ * not count.
+ */
 void        allocator_max_free_set(allocator_t *mem_allocator, size_t in_size);
+bool        allocator_thread_cache_enable(allocator_t *mem_allocator);
+
+/* Give cached nodes back to the system until no more than target_bytes
+ * are cached, the sink first, then the buckets from the largest size
+ * down, each least recently freed first.  The nodes of the lock-free
+ * buckets are unmapped once no racing pop can read them, as for
+ * allocator_max_free_set().  The thread caches are left alone.  Returns
+ * the bytes taken out of the cache.
+ */
+size_t      allocator_trim(allocator_t *mem_allocator, size_t target_bytes);
+/* With HAS_THREADS, a thread trims the allocator every period_ms down to
+ * target_bytes, giving back only nodes unused for a whole period.  An
+ * allocator without a lock gets one until the thread is stopped, start
+ * and stop it then before sharing the allocator.  Destroying the
+ * allocator stops the thread.
+ */
+bool        allocator_reclaimer_start(allocator_t *mem_allocator, unsigned int period_ms,
+                                      size_t target_bytes);
+void        allocator_reclaimer_stop(allocator_t *mem_allocator);
+
+/* NUMA: an allocator created with numa_bind maps its nodes, also without
+ * ALLOCATOR_USES_MAP, and asks the system to place them on numa_node.
+ * That is a preference: memory from another node is used when the node
+ * is full or does not exist.  allocator_numa_node() returns the memory
+ * node of the CPU the calling thread runs on (0 if unknown), and
+ * allocator_numa_pick() the first of count allocators bound to it, or
+ * allocators[0] if none is, NULL if count is 0.
+ */
+int         allocator_numa_node(void);
+allocator_t *allocator_numa_pick(allocator_t *const *mem_allocators, size_t count);
+
+/* Shared memory: an allocator created with shm_name makes a segment of
+ * shm_size bytes under that name, replacing one that exists, and carves
+ * its nodes from it; the allocator fails once the segment is used up.
+ * Destroying the allocator removes the name.  mempool_handoff() destroys
+ * a pool on such an allocator like mempool_destroy(), but hands its nodes
+ * to the process that opened the segment with mempool_shm_open() instead
+ * of freeing them; its subpools are destroyed.  The consumer takes the
+ * batches in the order they were handed off with mempool_shm_receive(),
+ * walks the nodes of a batch, in no particular order, with
+ * mempool_shm_next() and reads the bytes allocated from each one through
+ * mempool_shm_data().  mempool_shm_return() gives a whole batch back,
+ * the allocator reuses its nodes when it runs out of cached ones.  Only
+ * one thread may use a mempool_shm_t.
+ */
+bool        mempool_handoff(mempool_t *pool);
+bool        mempool_shm_open(mempool_shm_t **shm, const char *name);
+void        mempool_shm_close(mempool_shm_t *shm);
+memnode_t   *mempool_shm_receive(mempool_shm_t *shm);
+memnode_t   *mempool_shm_next(mempool_shm_t *shm, memnode_t *node);
+void        *mempool_shm_data(mempool_shm_t *shm, memnode_t *node, size_t *size);
+void        mempool_shm_return(mempool_shm_t *shm, memnode_t *batch);
+
+bool        allocator_stats_get(allocator_t *mem_allocator, allocator_stats_t *stats);
+bool        allocator_bucket_stats_get(allocator_t *mem_allocator, size_t index,
+                                       allocator_bucket_stats_t *stats);
+
+/* Consistency checks for tests, false when an invariant is broken.
+ * Other threads must leave the allocator (pool tree) alone meanwhile.
+ */
+bool        allocator_check(allocator_t *mem_allocator);
+bool        mempool_check(mempool_t *pool);
 
 bool        mempool_create(mempool_t **newpool, mempool_t *parent, allocator_t *mem_allocator);
 bool        mempool_create_unmanaged(mempool_t **newpool, allocator_t *mem_allocator);
+/* A subpool that costs a few hundred bytes of the parent until it is
+ * used: its structure is allocated from the parent, it takes a node on
+ * its first allocation of more than 0 bytes (blocks of 0 bytes point
+ * into its structure until then), and it is linked to the parent
+ * without a lock.
+ * Only the thread allocating from the parent may create or destroy it,
+ * and it uses the parent's allocator.  Rewinding the parent past its
+ * creation destroys it, and it cannot be handed off.
+ */
+bool        mempool_create_lazy(mempool_t **newpool, mempool_t *parent);
 void        mempool_clear(mempool_t *pool);
 void        mempool_destroy(mempool_t *pool);
 
+/* Byte budgets: the nodes held by a pool and its subpools, including
+ * the ones holding the pool structures, may not grow past the pool's
+ * limit, 0 for none.  A pool over its own or an ancestor's limit gets no
+ * new node, the allocation or mempool_create() fails.  Lowering a limit
+ * below the usage frees nothing.  mempool_usage() returns the bytes held
+ * by the pool and its subpools.  The global pool, the parent of pools
+ * created with a NULL parent, is not counted: a limit on it (or on NULL)
+ * is ignored and its usage stays 0.
+ */
+void        mempool_limit_set(mempool_t *pool, size_t limit_bytes);
+size_t      mempool_usage(mempool_t *pool);
+/* The abort function is called before a failure for a limit or for lack
+ * of memory, subpools created later inherit it.  It may throw or exit,
+ * the failure stands if it returns.
+ */
+void        mempool_abort_set(mempool_t *pool, mempool_abort_fn abort_fn);
+
+/* Node retention: mempool_clear() keeps up to max_bytes of the pool's
+ * nodes, besides the one holding the pool, reset in place for the next
+ * round instead of giving them back to the allocator.  With adaptive the
+ * pool also learns the bytes of nodes it needs between two clears and
+ * keeps no more than that: a higher peak is taken at once, a lower one
+ * an eighth of the way per clear.  Kept nodes count towards the usage
+ * and the limits, and are only allocated from while no mark is pending.
+ * 0 keeps nothing, the default; subpools do not inherit it.
+ */
+void        mempool_retain_set(mempool_t *pool, size_t max_bytes, bool adaptive);
+
 void        *mempool_alloc(mempool_t *pool, size_t in_size);
 void        *mempool_calloc(mempool_t *pool, size_t in_size);
 
+/* Concurrent pools: once mempool_concurrent_enable() succeeded, threads
+ * may allocate from the pool at once with mempool_alloc_concurrent(),
+ * which claims blocks off the active node with a CAS and only locks the
+ * pool to move on to another node, and create subpools of it on an
+ * allocator with a lock.  Anything else, mempool_alloc() included, waits
+ * until they are done; the pool is cleared or destroyed as a whole.  A
+ * mempool_arena_t belongs to one thread and bumps blocks off chunks it
+ * claims from the pool, without any atomic operation; the rest of a
+ * chunk is given up when the next is claimed.  False without
+ * HAS_THREADS, mempool_alloc_concurrent() is then mempool_alloc().
+ */
+bool        mempool_concurrent_enable(mempool_t *pool);
+void        *mempool_alloc_concurrent(mempool_t *pool, size_t in_size);
+void        mempool_arena_init(mempool_arena_t *arena, mempool_t *pool);
+void        *mempool_arena_alloc(mempool_arena_t *arena, size_t in_size);
+
+/* Fill out[0..count-1] with blocks of in_size bytes taken from as few
+ * nodes as possible.  A new node is no larger than the largest one the
+ * allocator caches in its buckets, unless one block is.  False when the
+ * pool ran out of memory on the way: out[] is then filled only up to the
+ * block that failed, and the blocks already handed out stay allocated
+ * until the pool is cleared, rewound or destroyed.  With POOL_GUARD_FLUSH
+ * every block is placed as mempool_alloc() places it.
+ */
+bool        mempool_alloc_many(mempool_t *pool, size_t in_size, size_t count, void **out);
+/* One contiguous run of count elements of in_size bytes, the elements
+ * are in_size rounded up to a multiple of 8 bytes apart.
+ */
+void        *mempool_alloc_array(mempool_t *pool, size_t in_size, size_t count);
+
+/* Resize the block at ptr of old_size bytes.  The last block of the
+ * active node grows or shrinks in place, any other one is copied when it
+ * grows; the old copy stays in the pool until it is cleared.
+ */
+void        *mempool_realloc(mempool_t *pool, void *ptr, size_t old_size, size_t new_size);
+/* Bytes the block at ptr of size bytes can grow by in place. */
+size_t      mempool_realloc_avail(mempool_t *pool, const void *ptr, size_t size);
+
+/* Cleanups run latest first when the pool is cleared or destroyed,
+ * after its subpools are gone and before its memory is, or on the
+ * rewind of a mark taken before they were registered.  The records
+ * are allocated from the pool.  mempool_cleanup_kill() returns false
+ * when no such cleanup is registered, mempool_cleanup_run() kills it
+ * and calls it right away.
+ */
+bool        mempool_cleanup_register(mempool_t *pool, void *data, void (*cleanup)(void *data));
+bool        mempool_cleanup_kill(mempool_t *pool, void *data, void (*cleanup)(void *data));
+void        mempool_cleanup_run(mempool_t *pool, void *data, void (*cleanup)(void *data));
+
+/* mempool_rewind() frees everything allocated from the pool since the
+ * matching mempool_mark(), giving the nodes got meanwhile back to the
+ * allocator and running the cleanups registered meanwhile; subpools are
+ * left alone.  Marks nest and are rewound last
+ * in first out, a rewind drops the marks taken after its own.  Blocks
+ * from before the mark must not be resized in place until the rewind.
+ */
+void        mempool_mark(mempool_t *pool, mempool_mark_t *mark);
+void        mempool_rewind(mempool_t *pool, const mempool_mark_t *mark);
+
+/* A slab recycles objects of object_size bytes allocated from the pool,
+ * mempool_slab_free() keeps an object for the next mempool_slab_alloc().
+ * The slab and its objects live in the pool and go with it on clear or
+ * destroy.  When the pool is rewound past objects the slab carved, the
+ * slab forgets all of its freed objects.
+ */
+bool        mempool_slab_create(mempool_slab_t **newslab, mempool_t *pool, size_t object_size);
+void        *mempool_slab_alloc(mempool_slab_t *slab);
+void        mempool_slab_free(mempool_slab_t *slab, void *object);
+
+/* Blocks aligned to 'alignment', a power of 2, NULL for other values.
+ * The padding up to the alignment comes out of the active node whenever
+ * the block fits there, however large it is: a new node would pad by as
+ * much on average, and the rest of the active node stays in use behind
+ * the block.  A block that does not fit gets a node of in_size plus
+ * alignment bytes.  Either way less than 'alignment' bytes are wasted.
+ * With POOL_GUARD_FLUSH the block ends as close to the guard page as the
+ * alignment lets it, in a node of its own.
+ */
+void        *mempool_alloc_aligned(mempool_t *pool, size_t in_size, size_t alignment);
+void        *mempool_calloc_aligned(mempool_t *pool, size_t in_size, size_t alignment);
+
+bool        mempool_stats_get(mempool_t *pool, mempool_stats_t *stats);
+void        mempool_stats_dump(mempool_t *pool, FILE *out);
+
 bool        pool_initialize(void);
 void        pool_terminate(void);
 
+/* Inline fast path of mempool_alloc(): a block that fits into the active
+ * node is bumped off it in place, only the spill to another node calls
+ * into mempool.cpp.  These are the leading members of mempool_t and
+ * memnode_t it reads, mempool.cpp checks that they match.  Build with
+ * the same HAS_STATS and POOL_GUARD_FLUSH as mempool.cpp, and with
+ * AddressSanitizer on both or neither; with any of those, every block is
+ * allocated out of line.  The spill goes through mempool_alloc_spill(),
+ * whose symbol is named after the three: a mismatch fails to link.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define MEMPOOL_USES_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MEMPOOL_USES_ASAN
+#endif
+#endif
+
+#if defined(HAS_STATS) || defined(POOL_GUARD_FLUSH) || defined(MEMPOOL_USES_ASAN)
+#define MEMPOOL_NO_INLINE
+#endif
+
+#ifdef HAS_STATS
+#define MEMPOOL_ABI_STATS   1
+#else
+#define MEMPOOL_ABI_STATS   0
+#endif
+#ifdef POOL_GUARD_FLUSH
+#define MEMPOOL_ABI_GUARD   1
+#else
+#define MEMPOOL_ABI_GUARD   0
+#endif
+#ifdef MEMPOOL_USES_ASAN
+#define MEMPOOL_ABI_ASAN    1
+#else
+#define MEMPOOL_ABI_ASAN    0
+#endif
+#define MEMPOOL_ABI_PASTE(name, s, g, a)    name##_stats##s##_guard##g##_asan##a
+#define MEMPOOL_ABI_NAME(name, s, g, a)     MEMPOOL_ABI_PASTE(name, s, g, a)
+#define mempool_alloc_spill \
+    MEMPOOL_ABI_NAME(mempool_alloc_spill, MEMPOOL_ABI_STATS, MEMPOOL_ABI_GUARD, MEMPOOL_ABI_ASAN)
+
+/* mempool_alloc() for the inline paths, under the name of the build */
+void        *mempool_alloc_spill(mempool_t *pool, size_t in_size);
+
+#if defined(__GNUC__)
+#define MEMPOOL_MAY_ALIAS   __attribute__((__may_alias__))
+#else
+#define MEMPOOL_MAY_ALIAS
+#endif
+
+typedef struct MEMPOOL_MAY_ALIAS mempool_head_t {
+    memnode_t       *active;
+} mempool_head_t;
+
+typedef struct MEMPOOL_MAY_ALIAS memnode_head_t {
+    char            *first_avail;
+    char            *endp;
+} memnode_head_t;
+
+/* Take size bytes, a multiple of MEMPOOL_ALIGNMENT, off the active node,
+ * NULL when they do not fit.
+ */
+inline void *mempool_alloc_bump(mempool_t *pool, size_t size)
+{
+#ifndef MEMPOOL_NO_INLINE
+    memnode_head_t  *active = (memnode_head_t *)((mempool_head_t *)pool)->active;
+    char            *mem = active->first_avail;
+
+    if (size <= (size_t)(active->endp - mem)) {
+        active->first_avail = mem + size;
+        return mem;
+    }
+#else
+    (void)pool;
+    (void)size;
+#endif
+    return NULL;
+}
+
+inline void *mempool_alloc_inline(mempool_t *pool, size_t in_size)
+{
+    size_t  size = (in_size + (MEMPOOL_ALIGNMENT - 1)) & ~(size_t)(MEMPOOL_ALIGNMENT - 1);
+    void    *mem;
+
+    if (size >= in_size && (mem = mempool_alloc_bump(pool, size)) != NULL) {
+        return mem;
+    }
+    return mempool_alloc_spill(pool, in_size);
+}
+
+#ifdef __cplusplus
+/* mempool_alloc() of a size known at compile time, the rounding folds
+ * away.
+ */
+template <size_t N>
+inline void *mempool_alloc(mempool_t *pool)
+{
+    static_assert(N <= (size_t)-1 - (MEMPOOL_ALIGNMENT - 1), "block too large");
+    const size_t    size = (N + (MEMPOOL_ALIGNMENT - 1)) & ~(size_t)(MEMPOOL_ALIGNMENT - 1);
+    void            *mem;
+
+    if ((mem = mempool_alloc_bump(pool, size)) != NULL) {
+        return mem;
+    }
+    return mempool_alloc_spill(pool, N);
+}
+
+/* Destructor call registered by mempool_new<T>() */
+template <typename T>
+void mempool_object_cleanup(void *data)
+{
+    static_cast<T *>(data)->~T();
+}
+
+/* Construct a T in the pool, its destructor runs when the pool is
+ * cleared or destroyed.  No cleanup is registered for a trivially
+ * destructible T.  NULL when out of memory.
+ */
+template <typename T, typename... Args>
+T *mempool_new(mempool_t *pool, Args&&... args)
+{
+    void    *mem;
+    T       *object;
+
+    if (std::alignment_of<T>::value <= MEMPOOL_ALIGNMENT) {
+        mem = mempool_alloc<sizeof(T)>(pool);
+    }
+    else {
+        mem = mempool_alloc_aligned(pool, sizeof(T), std::alignment_of<T>::value);
+    }
+    if (mem == NULL) {
+        return NULL;
+    }
+    object = new (mem) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value
+        && !mempool_cleanup_register(pool, object, mempool_object_cleanup<T>)) {
+        object->~T();
+        return NULL;
+    }
+    return object;
+}
+
+/* Destroy an object from mempool_new<T>() before its pool goes, its
+ * memory stays in the pool.
+ */
+template <typename T>
+void mempool_delete(mempool_t *pool, T *object)
+{
+    if (std::is_trivially_destructible<T>::value) {
+        object->~T();
+    }
+    else {
+        mempool_cleanup_run(pool, object, mempool_object_cleanup<T>);
+    }
+}
+#endif //__cplusplus
+
 #endif //_MEMPOOL_H_
\ No newline at end of file
@@ -0,0 +1,125 @@
+/*//////////////////////////////////////////////////////////////////////////
+Standard library adapters for the memory pool.
+
+mempool_allocator<T> is an allocator for the standard containers, and
+with C++17 mempool_resource is a std::pmr::memory_resource for the pmr
+containers.  Both take their memory from a pool and never give single
+blocks back, the memory goes when the pool is cleared or destroyed.  A
+container must therefore not outlive its pool; objects with destructors
+it holds still need the container's own destructor to run.
+//////////////////////////////////////////////////////////////////////////*/
+#ifndef _MEMPOOL_ALLOCATOR_H_
+#define _MEMPOOL_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include "mempool.h"
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L) \
+    || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#define MEMPOOL_HAS_PMR
+#endif
+#endif
+#endif
+
+#ifdef MEMPOOL_HAS_PMR
+#include <memory_resource>
+#endif
+
+template <typename T>
+class mempool_allocator {
+public:
+    typedef T           value_type;
+    typedef T           *pointer;
+    typedef const T     *const_pointer;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef mempool_allocator<U> other;
+    };
+
+    explicit mempool_allocator(mempool_t *pool) : pool_(pool) {}
+
+    template <typename U>
+    mempool_allocator(const mempool_allocator<U> &other) : pool_(other.pool()) {}
+
+    T *allocate(size_t n)
+    {
+        void *mem;
+
+        if (n > (size_t)-1 / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        if (std::alignment_of<T>::value <= MEMPOOL_ALIGNMENT) {
+            mem = mempool_alloc_inline(pool_, n * sizeof(T));
+        }
+        else {
+            mem = mempool_alloc_aligned(pool_, n * sizeof(T), std::alignment_of<T>::value);
+        }
+        if (mem == NULL) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(mem);
+    }
+
+    /* The memory goes back with the pool */
+    void deallocate(T *, size_t) {}
+
+    mempool_t *pool() const { return pool_; }
+
+private:
+    mempool_t   *pool_;
+};
+
+template <typename T, typename U>
+bool operator==(const mempool_allocator<T> &a, const mempool_allocator<U> &b)
+{
+    return a.pool() == b.pool();
+}
+
+template <typename T, typename U>
+bool operator!=(const mempool_allocator<T> &a, const mempool_allocator<U> &b)
+{
+    return a.pool() != b.pool();
+}
+
+#ifdef MEMPOOL_HAS_PMR
+class mempool_resource : public std::pmr::memory_resource {
+public:
+    explicit mempool_resource(mempool_t *pool) : pool_(pool) {}
+
+    mempool_t *pool() const { return pool_; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        void *mem = alignment <= MEMPOOL_ALIGNMENT ? mempool_alloc_inline(pool_, bytes)
+            : mempool_alloc_aligned(pool_, bytes, alignment);
+
+        if (mem == NULL) {
+            throw std::bad_alloc();
+        }
+        return mem;
+    }
+
+    /* The memory goes back with the pool */
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const mempool_resource *resource = dynamic_cast<const mempool_resource *>(&other);
+
+        return resource != NULL && resource->pool_ == pool_;
+    }
+
+private:
+    mempool_t   *pool_;
+};
+#endif //MEMPOOL_HAS_PMR
+
+#endif //_MEMPOOL_ALLOCATOR_H_
\ No newline at end of file
@@ -0,0 +1,625 @@
+/*//////////////////////////////////////////////////////////////////////////
+Benchmarks for the memory pool, Linux only.
+
+g++ -O2 pool_bench.cpp mempool.cpp -o pool_bench -DHAS_THREADS -lpthread
+./pool_bench [scale]
+
+Every case runs against mempool and against plain malloc/free doing the
+same work (the malloc side frees its blocks where the pool is cleared),
+and reports throughput, per-operation latency percentiles, resident set
+size and last level cache misses (when perf events are available).
+//////////////////////////////////////////////////////////////////////////*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "mempool.h"
+
+/* Operations are timed in batches, a clock read per allocation would
+ * cost more than the allocation itself.
+ */
+#define BATCH           64
+#define MAX_SAMPLES     (1 << 16)
+
+static unsigned long    g_scale = 1;
+
+
+/*//////////////////////////////////////////////////////////////////////////
+Measurement helpers
+//////////////////////////////////////////////////////////////////////////*/
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Resident set size in KiB */
+static unsigned long rss_kb(void)
+{
+    unsigned long size = 0, resident = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/statm", "r")) == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Hardware cache miss counter of the calling thread and the threads it
+ * creates afterwards, -1 when perf events are not permitted.
+ */
+static int cache_misses_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_misses_read(int fd)
+{
+    uint64_t count = 0;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+typedef struct bench_t {
+    const char      *name;
+    uint64_t        start;
+    uint64_t        last;
+    unsigned long   ops;
+    unsigned long   rss_start;
+    unsigned long   rss_peak;
+    int             perf_fd;
+    size_t          nsamples;
+    float           *samples;       /**< ns per operation of each batch */
+} bench_t;
+
+static void bench_begin(bench_t *bench, const char *name)
+{
+    memset(bench, 0, sizeof(*bench));
+    bench->name = name;
+    bench->samples = (float *)malloc(MAX_SAMPLES * sizeof(float));
+    bench->rss_start = rss_kb();
+    if ((bench->perf_fd = cache_misses_open()) >= 0) {
+        ioctl(bench->perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    bench->start = bench->last = now_ns();
+}
+
+/* Account for 'ops' operations done since the previous call. */
+static void bench_tick(bench_t *bench, unsigned long ops)
+{
+    uint64_t now = now_ns();
+
+    if (bench->nsamples < MAX_SAMPLES) {
+        bench->samples[bench->nsamples++] = (float)(now - bench->last) / ops;
+    }
+    else {
+        /* reservoir sampling keeps the percentiles honest for long runs */
+        size_t i = (size_t)rand() % (bench->ops / ops + 1);
+        if (i < MAX_SAMPLES)
+            bench->samples[i] = (float)(now - bench->last) / ops;
+    }
+    bench->ops += ops;
+    bench->last = now;
+}
+
+static int compare_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_end(bench_t *bench)
+{
+    uint64_t        elapsed = now_ns() - bench->start;
+    uint64_t        misses;
+    unsigned long   rss = rss_kb();
+    float           p50 = 0, p99 = 0, p999 = 0;
+
+    misses = cache_misses_read(bench->perf_fd);
+    if (bench->perf_fd >= 0)
+        close(bench->perf_fd);
+    if (rss > bench->rss_peak)
+        bench->rss_peak = rss;
+
+    if (bench->nsamples != 0) {
+        qsort(bench->samples, bench->nsamples, sizeof(float), compare_float);
+        p50 = bench->samples[bench->nsamples / 2];
+        p99 = bench->samples[bench->nsamples * 99 / 100];
+        p999 = bench->samples[bench->nsamples * 999 / 1000];
+    }
+    printf("%-28s %9.2f Mops/s  p50 %7.1f  p99 %7.1f  p99.9 %8.1f ns"
+        "  rss %+8ld KiB",
+        bench->name, bench->ops * 1e3 / (elapsed ? elapsed : 1),
+        p50, p99, p999, (long)bench->rss_peak - (long)bench->rss_start);
+    if (bench->perf_fd >= 0)
+        printf("  llc-miss/op %6.2f", (double)misses / (bench->ops ? bench->ops : 1));
+    printf("\n");
+    free(bench->samples);
+}
+
+/* Sample the RSS now and then, it is only read back at the end. */
+static void bench_rss(bench_t *bench)
+{
+    unsigned long rss = rss_kb();
+
+    if (rss > bench->rss_peak)
+        bench->rss_peak = rss;
+}
+
+
+/*//////////////////////////////////////////////////////////////////////////
+Size distributions
+//////////////////////////////////////////////////////////////////////////*/
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+typedef size_t (*size_fn_t)(uint64_t *state);
+
+/* 8 .. 64 bytes, strings and small structs */
+static size_t size_tiny(uint64_t *state)
+{
+    return 8 + rng_next(state) % 57;
+}
+
+/* mostly small, now and then a buffer of a few KiB */
+static size_t size_mixed(uint64_t *state)
+{
+    uint64_t r = rng_next(state);
+
+    if ((r & 15) != 0)
+        return 16 + (r >> 8) % 240;
+    return 256 + (r >> 8) % 8192;
+}
+
+/* Pareto like tail reaching far beyond the largest bucket into the sink */
+static size_t size_heavy(uint64_t *state)
+{
+    uint64_t r = rng_next(state);
+    unsigned int shift = (unsigned int)(r & 63) < 48 ? 4 + (r >> 6) % 6
+        : 10 + (r >> 6) % 13;
+
+    return ((size_t)1 << shift) + (r >> 16) % ((size_t)1 << shift);
+}
+
+static const struct {
+    const char  *name;
+    size_fn_t   fn;
+} g_dists[] = {
+    { "tiny", size_tiny },
+    { "mixed", size_mixed },
+    { "heavy", size_heavy },
+};
+
+
+/*//////////////////////////////////////////////////////////////////////////
+Cases
+//////////////////////////////////////////////////////////////////////////*/
+/* Requests of the given distribution, the pool is cleared (and the malloc
+ * blocks freed) whenever 'reset_bytes' have been handed out.  With
+ * 'retain' the pool keeps the nodes it needs over the clears.
+ */
+static void bench_alloc_pool(const char *name, size_fn_t fn, size_t reset_bytes, bool retain)
+{
+    bench_t     bench;
+    mempool_t   *pool;
+    uint64_t    state = 88172645463325252ull;
+    unsigned long i, n = 2000000 * g_scale;
+    size_t      used = 0;
+
+    mempool_create(&pool, NULL, NULL);
+    if (retain)
+        mempool_retain_set(pool, (size_t)-1, true);
+    bench_begin(&bench, name);
+    for (i = 0; i < n; i += BATCH) {
+        for (int j = 0; j < BATCH; j++) {
+            size_t size = fn(&state);
+            char *p = (char *)mempool_alloc(pool, size);
+            p[0] = 1;
+            used += size;
+        }
+        if (used >= reset_bytes) {
+            bench_rss(&bench);
+            mempool_clear(pool);
+            used = 0;
+        }
+        bench_tick(&bench, BATCH);
+    }
+    bench_end(&bench);
+    mempool_destroy(pool);
+}
+
+static void bench_alloc_malloc(const char *name, size_fn_t fn, size_t reset_bytes)
+{
+    bench_t     bench;
+    uint64_t    state = 88172645463325252ull;
+    unsigned long i, n = 2000000 * g_scale;
+    size_t      used = 0, count = 0, max = 1 << 16;
+    void        **blocks = (void **)malloc(max * sizeof(void *));
+
+    bench_begin(&bench, name);
+    for (i = 0; i < n; i += BATCH) {
+        for (int j = 0; j < BATCH; j++) {
+            size_t size = fn(&state);
+            char *p = (char *)malloc(size);
+            p[0] = 1;
+            used += size;
+            if (count == max) {
+                max *= 2;
+                blocks = (void **)realloc(blocks, max * sizeof(void *));
+            }
+            blocks[count++] = p;
+        }
+        if (used >= reset_bytes) {
+            bench_rss(&bench);
+            while (count)
+                free(blocks[--count]);
+            used = 0;
+        }
+        bench_tick(&bench, BATCH);
+    }
+    bench_end(&bench);
+    while (count)
+        free(blocks[--count]);
+    free(blocks);
+}
+
+/* Zeroed buffers of 'size' bytes, a few written to before the pool is
+ * cleared, on a fresh pool each time or on one that keeps its nodes.
+ */
+static void bench_calloc_pool(const char *name, size_t size, bool fresh)
+{
+    bench_t     bench;
+    mempool_t   *pool = NULL;
+    unsigned long i, n = (20000 * g_scale) / (size >> 16 | 1);
+
+    if (!fresh) {
+        mempool_create(&pool, NULL, NULL);
+        mempool_retain_set(pool, (size_t)-1, true);
+    }
+    bench_begin(&bench, name);
+    for (i = 0; i < n; i += 8) {
+        if (fresh)
+            mempool_create(&pool, NULL, NULL);
+        for (int j = 0; j < 8; j++) {
+            char *p = (char *)mempool_calloc(pool, size);
+            p[size / 2] = 1;
+        }
+        if (fresh)
+            mempool_destroy(pool);
+        else
+            mempool_clear(pool);
+        bench_tick(&bench, 8);
+    }
+    bench_end(&bench);
+    if (!fresh)
+        mempool_destroy(pool);
+}
+
+static void bench_calloc_malloc(const char *name, size_t size)
+{
+    bench_t     bench;
+    char        *blocks[8];
+    unsigned long i, n = (20000 * g_scale) / (size >> 16 | 1);
+
+    bench_begin(&bench, name);
+    for (i = 0; i < n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            blocks[j] = (char *)calloc(1, size);
+            blocks[j][size / 2] = 1;
+        }
+        for (int j = 0; j < 8; j++)
+            free(blocks[j]);
+        bench_tick(&bench, 8);
+    }
+    bench_end(&bench);
+}
+
+/* Same sized records, one call per record, inlined or not, or one call
+ * per batch
+ */
+enum { RECORDS_CALL, RECORDS_INLINE, RECORDS_BATCH };
+
+static void bench_records(int mode)
+{
+    static const char *names[] = {
+        "records mempool_alloc", "records mempool_alloc<48>", "records mempool_alloc_many"
+    };
+    bench_t     bench;
+    mempool_t   *pool;
+    void        *records[BATCH];
+    unsigned long i, n = 4000000 * g_scale;
+
+    mempool_create(&pool, NULL, NULL);
+    bench_begin(&bench, names[mode]);
+    for (i = 0; i < n; i += BATCH) {
+        if (mode == RECORDS_BATCH) {
+            mempool_alloc_many(pool, 48, BATCH, records);
+        }
+        else if (mode == RECORDS_INLINE) {
+            for (int j = 0; j < BATCH; j++)
+                records[j] = mempool_alloc<48>(pool);
+        }
+        else {
+            for (int j = 0; j < BATCH; j++)
+                records[j] = mempool_alloc(pool, 48);
+        }
+        *(char *)records[BATCH - 1] = 1;
+        if ((i & ((1 << 16) - 1)) == 0)
+            mempool_clear(pool);
+        bench_tick(&bench, BATCH);
+    }
+    bench_end(&bench);
+    mempool_destroy(pool);
+}
+
+/* A request scoped pool: create, a few dozen allocations, destroy. */
+static void bench_cycle_pool(void)
+{
+    bench_t     bench;
+    mempool_t   *pool;
+    uint64_t    state = 1;
+    unsigned long i, n = 200000 * g_scale;
+
+    bench_begin(&bench, "cycle create/destroy pool");
+    for (i = 0; i < n; i++) {
+        mempool_create(&pool, NULL, NULL);
+        for (int j = 0; j < 40; j++)
+            mempool_alloc(pool, size_mixed(&state));
+        mempool_destroy(pool);
+        if ((i & (BATCH / 4 - 1)) == BATCH / 4 - 1)
+            bench_tick(&bench, BATCH / 4);
+    }
+    bench_end(&bench);
+}
+
+/* Build a tree of 'fanout'^'depth' leaves, allocate in every pool, then
+ * tear it down from the root.
+ */
+static void tree_build(mempool_t *parent, int depth, int fanout, uint64_t *state)
+{
+    mempool_t *pool;
+
+    for (int i = 0; i < fanout; i++) {
+        mempool_create(&pool, parent, NULL);
+        for (int j = 0; j < 8; j++)
+            mempool_alloc(pool, size_tiny(state));
+        if (depth > 1)
+            tree_build(pool, depth - 1, fanout, state);
+    }
+}
+
+static void bench_tree(int depth, int fanout)
+{
+    char        name[64];
+    bench_t     bench;
+    mempool_t   *root;
+    uint64_t    state = 7;
+    unsigned long i, n = 200 * g_scale, pools = 0, width = 1;
+
+    for (int d = 0; d < depth; d++) {
+        width *= fanout;
+        pools += width;
+    }
+    snprintf(name, sizeof(name), "tree depth %d fanout %d", depth, fanout);
+    bench_begin(&bench, name);
+    for (i = 0; i < n; i++) {
+        mempool_create(&root, NULL, NULL);
+        tree_build(root, depth, fanout, &state);
+        bench_rss(&bench);
+        mempool_destroy(root);
+        bench_tick(&bench, pools);
+    }
+    bench_end(&bench);
+}
+
+/* A request pool with 64 subpools, only every eighth of them allocated
+ * from, as subpools made ahead of need mostly are.
+ */
+static void bench_subpools(bool lazy)
+{
+    bench_t     bench;
+    mempool_t   *root, *pool;
+    uint64_t    state = 11;
+    unsigned long i, n = 20000 * g_scale;
+
+    bench_begin(&bench, lazy ? "sparse subpools lazy" : "sparse subpools");
+    for (i = 0; i < n; i++) {
+        mempool_create(&root, NULL, NULL);
+        for (int j = 0; j < 64; j++) {
+            if (lazy)
+                mempool_create_lazy(&pool, root);
+            else
+                mempool_create(&pool, root, NULL);
+            if ((j & 7) == 0) {
+                for (int k = 0; k < 8; k++)
+                    mempool_alloc(pool, size_tiny(&state));
+            }
+        }
+        mempool_destroy(root);
+        bench_tick(&bench, 64);
+    }
+    bench_end(&bench);
+}
+
+#ifdef HAS_THREADS
+typedef struct thread_arg_t {
+    unsigned long   iterations;
+    uint64_t        seed;
+} thread_arg_t;
+
+static void *thread_main(void *data)
+{
+    thread_arg_t    *arg = (thread_arg_t *)data;
+    mempool_t       *pool;
+
+    for (unsigned long i = 0; i < arg->iterations; i++) {
+        mempool_create(&pool, NULL, NULL);
+        for (int j = 0; j < 40; j++)
+            mempool_alloc(pool, size_heavy(&arg->seed) & 0xffff);
+        mempool_destroy(pool);
+    }
+    return NULL;
+}
+
+/* Threads creating and destroying pools against the shared g_allocator */
+static void bench_threads(int nthreads)
+{
+    char            name[64];
+    bench_t         bench;
+    pthread_t       threads[64];
+    thread_arg_t    args[64];
+    unsigned long   n = 50000 * g_scale;
+
+    snprintf(name, sizeof(name), "threads %d create/destroy", nthreads);
+    bench_begin(&bench, name);
+    for (int i = 0; i < nthreads; i++) {
+        args[i].iterations = n;
+        args[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&threads[i], NULL, thread_main, &args[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    /* no per batch timing here, report the whole run as one sample */
+    bench_tick(&bench, n * nthreads);
+    bench_end(&bench);
+}
+
+typedef struct shared_arg_t {
+    mempool_t       *pool;
+    unsigned long   iterations;
+    uint64_t        seed;
+    bool            arena;
+} shared_arg_t;
+
+static void *shared_main(void *data)
+{
+    shared_arg_t    *arg = (shared_arg_t *)data;
+    mempool_arena_t arena;
+
+    mempool_arena_init(&arena, arg->pool);
+    for (unsigned long i = 0; i < arg->iterations; i++) {
+        size_t size = size_tiny(&arg->seed);
+        if (arg->arena)
+            mempool_arena_alloc(&arena, size);
+        else
+            mempool_alloc_concurrent(arg->pool, size);
+    }
+    return NULL;
+}
+
+/* Threads filling one request scoped pool, each claiming its blocks
+ * from the shared node or bumping them off its own arena.
+ */
+static void bench_shared(int nthreads, bool arena)
+{
+    char            name[64];
+    bench_t         bench;
+    mempool_t       *pool;
+    pthread_t       threads[64];
+    shared_arg_t    args[64];
+    unsigned long   n = 2000000 * g_scale;
+
+    mempool_create(&pool, NULL, NULL);
+    mempool_concurrent_enable(pool);
+    snprintf(name, sizeof(name), "threads %d shared %s", nthreads,
+        arena ? "arena" : "concurrent");
+    bench_begin(&bench, name);
+    for (int i = 0; i < nthreads; i++) {
+        args[i].pool = pool;
+        args[i].iterations = n;
+        args[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        args[i].arena = arena;
+        pthread_create(&threads[i], NULL, shared_main, &args[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    bench_tick(&bench, n * nthreads);
+    bench_rss(&bench);
+    bench_end(&bench);
+    mempool_destroy(pool);
+}
+#endif //HAS_THREADS
+
+int main(int argc, char *argv[])
+{
+    char name[64];
+
+    if (argc > 1 && (g_scale = strtoul(argv[1], NULL, 10)) == 0)
+        g_scale = 1;
+    if (!pool_initialize()) {
+        fprintf(stderr, "pool_initialize failed\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(g_dists) / sizeof(g_dists[0]); i++) {
+        snprintf(name, sizeof(name), "alloc %s mempool", g_dists[i].name);
+        bench_alloc_pool(name, g_dists[i].fn, 4 << 20, false);
+        snprintf(name, sizeof(name), "alloc %s malloc", g_dists[i].name);
+        bench_alloc_malloc(name, g_dists[i].fn, 4 << 20);
+    }
+    /* short lived pools, cleared every 64 KiB */
+    bench_alloc_pool("clear/reuse 64K mempool", size_mixed, 64 << 10, false);
+    bench_alloc_pool("clear/reuse 64K retained", size_mixed, 64 << 10, true);
+    bench_alloc_malloc("clear/reuse 64K malloc", size_mixed, 64 << 10);
+    /* zeroed record buffers */
+    bench_calloc_pool("calloc 16K mempool", 16 << 10, false);
+    bench_calloc_malloc("calloc 16K malloc", 16 << 10);
+    bench_calloc_pool("calloc 1M mempool fresh", 1 << 20, true);
+    bench_calloc_pool("calloc 1M mempool reused", 1 << 20, false);
+    bench_calloc_malloc("calloc 1M malloc", 1 << 20);
+    bench_calloc_pool("calloc 16M mempool reused", 16 << 20, false);
+    bench_calloc_malloc("calloc 16M malloc", 16 << 20);
+    bench_records(RECORDS_CALL);
+    bench_records(RECORDS_INLINE);
+    bench_records(RECORDS_BATCH);
+    bench_cycle_pool();
+    bench_tree(4, 6);
+    bench_tree(12, 2);
+    bench_subpools(false);
+    bench_subpools(true);
+#ifdef HAS_THREADS
+    bench_threads(1);
+    bench_threads(4);
+    bench_threads((int)sysconf(_SC_NPROCESSORS_ONLN) > 64 ? 64
+        : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    bench_shared(4, false);
+    bench_shared(4, true);
+#endif //HAS_THREADS
+
+    pool_terminate();
+    return 0;
+}
\ No newline at end of file
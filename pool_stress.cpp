@@ -0,0 +1,1081 @@
+/*//////////////////////////////////////////////////////////////////////////
+Randomized stress test of the pool API, meant to run under the sanitizers.
+
+g++ -g -O1 -fsanitize=address,undefined pool_stress.cpp mempool.cpp -o pool_stress -DHAS_THREADS -lpthread
+g++ -g -O1 -fsanitize=thread pool_stress.cpp mempool.cpp -o pool_stress -DHAS_THREADS -lpthread
+./pool_stress [iterations] [threads]
+
+Every thread grows and prunes a random tree of pools, on the global
+allocator and on a private one with a random geometry, fills every
+allocation with a pattern and verifies the patterns and the allocator
+and pool invariants as it goes.  Then all threads fill one concurrent
+pool at once.
+//////////////////////////////////////////////////////////////////////////*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#ifdef HAS_THREADS
+#include <pthread.h>
+#endif
+#include "mempool.h"
+#include "mempool_allocator.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define STRESS_USES_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define STRESS_USES_ASAN
+#endif
+#endif
+#ifdef STRESS_USES_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        abort();                                                        \
+    }                                                                   \
+} while (0)
+
+#define MAX_POOLS       48
+#define MAX_BLOCKS      24
+#define MAX_MARKS       4
+#define MAX_OBJECTS     32
+
+typedef struct block_t {
+    unsigned char   *mem;
+    size_t          size;
+    unsigned char   fill;
+} block_t;
+
+typedef struct slot_t {
+    mempool_t       *pool;
+    int             parent;         /**< slot of the parent, -1 for a root */
+    int             nblocks;
+    block_t         blocks[MAX_BLOCKS];
+    int             nmarks;
+    mempool_mark_t  marks[MAX_MARKS];
+    int             mark_blocks[MAX_MARKS];  /**< nblocks when marked */
+    mempool_slab_t  *slab;
+    int             slab_marks;     /**< nmarks when the slab was created */
+    size_t          slab_size;
+    int             nobjects;       /**< live slab objects */
+    unsigned char   *objects[MAX_OBJECTS];
+    int             object_marks[MAX_OBJECTS];
+} slot_t;
+
+typedef struct worker_t {
+    uint64_t        rng;
+    unsigned long   iterations;
+    allocator_t     *allocator;     /**< private allocator, may be NULL */
+    slot_t          slots[MAX_POOLS];
+    unsigned long   cleanups_registered;
+    unsigned long   cleanups_run;
+} worker_t;
+
+/* An object with a destructor living in a pool */
+struct tracked_t {
+    worker_t        *worker;
+    std::string     text;
+
+    tracked_t(worker_t *w, const char *s) : worker(w), text(s) {}
+    ~tracked_t() { worker->cleanups_run++; }
+};
+
+static void cleanup_count(void *data)
+{
+    ((worker_t *)data)->cleanups_run++;
+}
+
+static uint64_t rng_next(worker_t *worker)
+{
+    uint64_t x = worker->rng;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker->rng = x;
+}
+
+/* Mostly small requests, some that need a node of their own and a few
+ * that end up in the sink.
+ */
+static size_t random_size(worker_t *worker)
+{
+    uint64_t r = rng_next(worker);
+
+    switch (r % 32) {
+    case 0:
+        return (size_t)(r >> 8) % (512 << 10);
+    case 1:
+    case 2:
+        return (size_t)(r >> 8) % (16 << 10);
+    default:
+        return (size_t)(r >> 8) % 200;
+    }
+}
+
+/* Every byte of 'mem' is 'fill' */
+static bool bytes_equal(const unsigned char *mem, size_t size, unsigned char fill)
+{
+    return size == 0 || (mem[0] == fill && memcmp(mem, mem + 1, size - 1) == 0);
+}
+
+/* Large blocks are only sampled, an allocation overlapping one would
+ * still show up at some sampled byte or at the block's ends.
+ */
+static void blocks_verify(slot_t *slot)
+{
+    for (int i = 0; i < slot->nblocks; i++) {
+        block_t *block = &slot->blocks[i];
+        if (block->size <= 1024) {
+            CHECK(bytes_equal(block->mem, block->size, block->fill));
+            continue;
+        }
+        CHECK(bytes_equal(block->mem, 64, block->fill));
+        CHECK(bytes_equal(block->mem + block->size - 64, 64, block->fill));
+        for (size_t j = 0; j < block->size; j += 8) {
+            CHECK(block->mem[j] == block->fill);
+        }
+    }
+}
+
+/* Forget a pool and all of its descendants, the pool itself has been
+ * destroyed already.
+ */
+static void slot_forget(worker_t *worker, int index)
+{
+    worker->slots[index].pool = NULL;
+    worker->slots[index].nblocks = 0;
+    worker->slots[index].nmarks = 0;
+    worker->slots[index].slab = NULL;
+    worker->slots[index].nobjects = 0;
+    for (int i = 0; i < MAX_POOLS; i++) {
+        if (worker->slots[i].pool != NULL && worker->slots[i].parent == index) {
+            slot_forget(worker, i);
+        }
+    }
+}
+
+static void slot_create(worker_t *worker, int index)
+{
+    slot_t  *slot = &worker->slots[index];
+    int     parent = (int)(rng_next(worker) % MAX_POOLS);
+
+    if (worker->slots[parent].pool == NULL || parent == index) {
+        /* a new root, on the global or on the private allocator */
+        if (worker->allocator != NULL && (rng_next(worker) & 1)) {
+            CHECK(mempool_create_unmanaged(&slot->pool, worker->allocator));
+        }
+        else {
+            CHECK(mempool_create(&slot->pool, NULL, NULL));
+        }
+        /* some keep nodes over their clears */
+        if (rng_next(worker) % 4 == 0) {
+            mempool_retain_set(slot->pool, (size_t)(rng_next(worker) % 4) * (32 << 10),
+                               (rng_next(worker) & 1) != 0);
+        }
+        parent = -1;
+    }
+    else if (worker->slots[parent].nmarks == 0 && (rng_next(worker) & 1)) {
+        /* a lazy one, no rewind of the parent may take it */
+        CHECK(mempool_create_lazy(&slot->pool, worker->slots[parent].pool));
+    }
+    else {
+        CHECK(mempool_create(&slot->pool, worker->slots[parent].pool, NULL));
+    }
+    slot->parent = parent;
+    slot->nblocks = 0;
+    slot->nmarks = 0;
+    slot->slab = NULL;
+    slot->nobjects = 0;
+}
+
+static void block_record(worker_t *worker, slot_t *slot, unsigned char *mem, size_t size)
+{
+    block_t *block;
+
+    if (slot->nblocks < MAX_BLOCKS) {
+        block = &slot->blocks[slot->nblocks++];
+    }
+    else if (slot->nmarks == 0) {
+        block = &slot->blocks[rng_next(worker) % MAX_BLOCKS];
+    }
+    else {
+        /* keep the blocks of a mark in place until its rewind */
+        return;
+    }
+    block->mem = mem;
+    block->size = size;
+    block->fill = (unsigned char)rng_next(worker);
+    memset(mem, block->fill, size);
+}
+
+/* A batch of same sized records, either separate or as one array */
+static void slot_alloc_many(worker_t *worker, slot_t *slot)
+{
+    void    *mem[64];
+    size_t  size = 1 + rng_next(worker) % 300;
+    size_t  count = 1 + rng_next(worker) % 64;
+
+    if (rng_next(worker) & 1) {
+        CHECK(mempool_alloc_many(slot->pool, size, count, mem));
+    }
+    else {
+        CHECK((mem[0] = mempool_alloc_array(slot->pool, size, count)) != NULL);
+        for (size_t i = 1; i < count; i++)
+            mem[i] = (char *)mem[0] + i * ((size + 7) & ~(size_t)7);
+    }
+    for (size_t i = 0; i < count; i++) {
+        CHECK(((uintptr_t)mem[i] & 7) == 0);
+        block_record(worker, slot, (unsigned char *)mem[i], size);
+    }
+}
+
+static void slot_alloc(worker_t *worker, slot_t *slot)
+{
+    size_t          size = random_size(worker);
+    bool            zeroed = (rng_next(worker) & 7) == 0;
+    size_t          alignment = 8;
+    unsigned char   *mem;
+
+    if ((rng_next(worker) & 3) == 0) {
+        alignment = (size_t)1 << (rng_next(worker) % 13);
+        mem = (unsigned char *)(zeroed
+            ? mempool_calloc_aligned(slot->pool, size, alignment)
+            : mempool_alloc_aligned(slot->pool, size, alignment));
+    }
+    else if (zeroed) {
+        mem = (unsigned char *)mempool_calloc(slot->pool, size);
+    }
+    else if ((rng_next(worker) & 1) == 0) {
+        mem = (unsigned char *)mempool_alloc(slot->pool, size);
+    }
+    else if ((rng_next(worker) & 3) != 0) {
+        mem = (unsigned char *)mempool_alloc_inline(slot->pool, size);
+    }
+    else {
+        /* a size known at compile time */
+        size = 44;
+        mem = (unsigned char *)mempool_alloc<44>(slot->pool);
+    }
+    CHECK(mem != NULL);
+    CHECK(((uintptr_t)mem & 7) == 0);
+    CHECK(((uintptr_t)mem & (alignment - 1)) == 0);
+    if (zeroed) {
+        CHECK(bytes_equal(mem, size, 0));
+    }
+#ifdef STRESS_USES_ASAN
+    /* the rest of the 8 byte granule is the poisoned node tail */
+    if (size % 8 != 0) {
+        CHECK(__asan_address_is_poisoned(mem + size));
+    }
+#endif
+    block_record(worker, slot, mem, size);
+}
+
+/* Grow or shrink one of the recorded blocks */
+static void slot_realloc(worker_t *worker, slot_t *slot)
+{
+    block_t         *block;
+    size_t          size = random_size(worker), avail;
+    unsigned char   *mem;
+
+    int             first = slot->nmarks ? slot->mark_blocks[slot->nmarks - 1] : 0;
+
+    /* blocks from before a mark are not to be resized in place */
+    if (slot->nblocks == first) {
+        return;
+    }
+    block = &slot->blocks[first + (int)(rng_next(worker) % (slot->nblocks - first))];
+    avail = mempool_realloc_avail(slot->pool, block->mem, block->size);
+    mem = (unsigned char *)mempool_realloc(slot->pool, block->mem, block->size, size);
+    CHECK(mem != NULL);
+    if (size <= block->size + avail) {
+        CHECK(mem == block->mem);
+    }
+    CHECK(bytes_equal(mem, size < block->size ? size : block->size, block->fill));
+    block->mem = mem;
+    block->size = size;
+    memset(mem, block->fill, size);
+}
+
+/* Register cleanups and construct objects with destructors, a plain
+ * cleanup registered twice has one of its registrations killed again.
+ */
+static void slot_cleanup(worker_t *worker, slot_t *slot)
+{
+    tracked_t   *object;
+
+    switch (rng_next(worker) % 4) {
+    case 0:
+        CHECK(mempool_cleanup_register(slot->pool, worker, cleanup_count));
+        worker->cleanups_registered++;
+        break;
+    case 1:
+        CHECK(mempool_cleanup_register(slot->pool, worker, cleanup_count));
+        CHECK(mempool_cleanup_register(slot->pool, worker, cleanup_count));
+        CHECK(mempool_cleanup_kill(slot->pool, worker, cleanup_count));
+        worker->cleanups_registered++;
+        break;
+    case 2:
+        object = mempool_new<tracked_t>(slot->pool, worker,
+            "a string too long for the small string buffer");
+        CHECK(object != NULL);
+        worker->cleanups_registered++;
+        break;
+    default:
+        object = mempool_new<tracked_t>(slot->pool, worker, "short");
+        CHECK(object != NULL);
+        worker->cleanups_registered++;
+        mempool_delete(slot->pool, object);
+        break;
+    }
+}
+
+/* Containers on the slot's pool, torn down before the next operation */
+static thread_local mempool_t *aborted_pool;
+
+static void limit_abort(mempool_t *pool, size_t)
+{
+    aborted_pool = pool;
+}
+
+/* Cap the pool's subtree a little above what it holds and allocate until
+ * the cap is hit, also by a new subpool that inherits the abort function.
+ */
+static void slot_limit(worker_t *worker, slot_t *slot)
+{
+    mempool_t   *child;
+    size_t      limit;
+
+    limit = mempool_usage(slot->pool) + (size_t)(rng_next(worker) % (256 << 10));
+    mempool_limit_set(slot->pool, limit);
+    mempool_abort_set(slot->pool, limit_abort);
+    aborted_pool = NULL;
+
+    if (mempool_create(&child, slot->pool, NULL)) {
+        CHECK(mempool_usage(slot->pool) <= limit);
+        while (mempool_alloc(child, random_size(worker)) != NULL)
+            CHECK(mempool_usage(slot->pool) <= limit);
+        CHECK(aborted_pool == child);
+        mempool_destroy(child);
+    }
+    else {
+        CHECK(aborted_pool == slot->pool);
+    }
+    aborted_pool = NULL;
+    for (int i = 0; i < 16 && mempool_alloc(slot->pool, random_size(worker)) != NULL; i++)
+        CHECK(mempool_usage(slot->pool) <= limit);
+    CHECK(aborted_pool == NULL || aborted_pool == slot->pool);
+
+    mempool_limit_set(slot->pool, 0);
+    mempool_abort_set(slot->pool, NULL);
+}
+
+/* The global pool takes no limit, the pools below it stay creatable. */
+static void global_limit_check(void)
+{
+    mempool_t   *pool;
+
+    mempool_limit_set(NULL, 1);
+    CHECK(mempool_create(&pool, NULL, NULL));
+    CHECK(mempool_alloc(pool, 1 << 20) != NULL);
+    CHECK(mempool_usage(pool) > (1 << 20));
+    mempool_destroy(pool);
+}
+
+static void slot_containers(worker_t *worker, slot_t *slot)
+{
+    typedef std::map<int, int, std::less<int>,
+                     mempool_allocator<std::pair<const int, int> > > map_t;
+    mempool_allocator<int>  allocator(slot->pool);
+    std::vector<int, mempool_allocator<int> > vector(allocator);
+    map_t                   map(std::less<int>(), allocator);
+    int                     n = (int)(rng_next(worker) % 2000);
+
+    for (int i = 0; i < n; i++) {
+        vector.push_back(i);
+        map[i * 7] = i;
+    }
+    for (int i = 0; i < n; i++) {
+        CHECK(vector[i] == i && map[i * 7] == i);
+    }
+#ifdef MEMPOOL_HAS_PMR
+    mempool_resource        resource(slot->pool);
+    std::pmr::vector<std::pmr::string> strings(&resource);
+
+    for (int i = 0; i < n / 8; i++) {
+        strings.emplace_back(40 + i % 16, (char)('a' + i % 26));
+    }
+    for (int i = 0; i < n / 8; i++) {
+        CHECK(strings[i].size() == (size_t)(40 + i % 16) && strings[i][0] == 'a' + i % 26);
+    }
+#endif //MEMPOOL_HAS_PMR
+}
+
+/* Objects of a slab are filled with the low byte of their address */
+static void slot_slab(worker_t *worker, slot_t *slot)
+{
+    unsigned char   *object;
+    int             i;
+
+    if (slot->slab == NULL) {
+        slot->slab_size = 1 + rng_next(worker) % 200;
+        CHECK(mempool_slab_create(&slot->slab, slot->pool, slot->slab_size));
+        slot->slab_marks = slot->nmarks;
+        slot->nobjects = 0;
+    }
+    if (slot->nobjects == MAX_OBJECTS || (slot->nobjects != 0 && (rng_next(worker) & 1))) {
+        i = (int)(rng_next(worker) % slot->nobjects);
+        object = slot->objects[i];
+        CHECK(bytes_equal(object, slot->slab_size, (unsigned char)(uintptr_t)object));
+        mempool_slab_free(slot->slab, object);
+        slot->objects[i] = slot->objects[--slot->nobjects];
+        slot->object_marks[i] = slot->object_marks[slot->nobjects];
+        return;
+    }
+    object = (unsigned char *)mempool_slab_alloc(slot->slab);
+    CHECK(object != NULL && ((uintptr_t)object & 7) == 0);
+    memset(object, (unsigned char)(uintptr_t)object, slot->slab_size);
+    slot->object_marks[slot->nobjects] = slot->nmarks;
+    slot->objects[slot->nobjects++] = object;
+}
+
+/* Take a mark or rewind to the latest one */
+static void slot_mark(worker_t *worker, slot_t *slot)
+{
+    if (slot->nmarks < MAX_MARKS && (slot->nmarks == 0 || (rng_next(worker) & 1))) {
+        mempool_mark(slot->pool, &slot->marks[slot->nmarks]);
+        slot->mark_blocks[slot->nmarks++] = slot->nblocks;
+        return;
+    }
+    slot->nmarks--;
+    mempool_rewind(slot->pool, &slot->marks[slot->nmarks]);
+    slot->nblocks = slot->mark_blocks[slot->nmarks];
+    blocks_verify(slot);
+    /* a slab from after the mark is gone, objects from after it may be */
+    if (slot->slab != NULL && slot->slab_marks > slot->nmarks) {
+        slot->slab = NULL;
+        slot->nobjects = 0;
+    }
+    for (int i = 0; i < slot->nobjects; ) {
+        if (slot->object_marks[i] > slot->nmarks) {
+            slot->objects[i] = slot->objects[--slot->nobjects];
+            slot->object_marks[i] = slot->object_marks[slot->nobjects];
+        }
+        else {
+            i++;
+        }
+    }
+    if (slot->parent == -1) {
+        CHECK(mempool_check(slot->pool));
+    }
+}
+
+/* Objects a slab carved under a mark and freed again must not come
+ * back after the rewind, the random walk rarely gets there.
+ */
+static void slab_rewind_check(void)
+{
+    mempool_t       *pool;
+    mempool_slab_t  *slab;
+    mempool_mark_t  mark;
+    unsigned char   *objects[200], *block;
+
+    CHECK(mempool_create(&pool, NULL, NULL));
+    CHECK(mempool_slab_create(&slab, pool, 48));
+    mempool_mark(pool, &mark);
+    for (int i = 0; i < 200; i++)
+        CHECK((objects[i] = (unsigned char *)mempool_slab_alloc(slab)) != NULL);
+    for (int i = 0; i < 200; i++)
+        mempool_slab_free(slab, objects[i]);
+    mempool_rewind(pool, &mark);
+
+    CHECK((block = (unsigned char *)mempool_alloc(pool, 200 * 48)) != NULL);
+    memset(block, 0x5a, 200 * 48);
+    for (int i = 0; i < 200; i++) {
+        CHECK((objects[i] = (unsigned char *)mempool_slab_alloc(slab)) != NULL);
+        memset(objects[i], 0xa5, 48);
+    }
+    CHECK(bytes_equal(block, 200 * 48, 0x5a));
+    mempool_destroy(pool);
+}
+
+/* A pool keeping its nodes over clears gets no new one once warm, and
+ * learns to give back what one large round took.
+ */
+static void retain_check(void)
+{
+    allocator_t     *allocator;
+    mempool_t       *pool;
+    unsigned char   *mem;
+    size_t          warm = 0, kept = 0, blocks;
+
+#ifdef POOL_GUARD_PROTECT_FREED
+    /* that mode keeps no node over a clear */
+    return;
+#endif
+    CHECK(allocator_create(&allocator));
+    CHECK(mempool_create_unmanaged(&pool, allocator));
+    mempool_retain_set(pool, (size_t)-1, true);
+    for (int round = 0; round < 100; round++) {
+        blocks = round == 10 ? 2000 : 200;
+        for (size_t i = 0; i < blocks; i++) {
+            CHECK((mem = (unsigned char *)mempool_alloc(pool, 200)) != NULL);
+            memset(mem, round, 200);
+        }
+        if (round > 0 && round != 10)
+            CHECK(mempool_usage(pool) == kept);
+        mempool_clear(pool);
+        CHECK(mempool_check(pool));
+        kept = mempool_usage(pool);
+        if (round == 0)
+            warm = kept;
+        CHECK(kept >= warm);
+    }
+    CHECK(kept == warm);
+
+    /* A fixed budget caps what is kept */
+    mempool_retain_set(pool, 16 << 10, false);
+    for (size_t i = 0; i < 2000; i++)
+        CHECK(mempool_alloc(pool, 200) != NULL);
+    mempool_clear(pool);
+    CHECK(mempool_check(pool));
+    CHECK(mempool_usage(pool) <= warm && mempool_usage(pool) > 0);
+    mempool_destroy(pool);
+    CHECK(allocator_check(allocator));
+    allocator_destroy(allocator);
+}
+
+/* A lazy subpool holds no node until its first allocation, and goes
+ * with a rewind of its parent past its creation.
+ */
+static void lazy_check(void)
+{
+    allocator_t     *allocator;
+    mempool_t       *parent, *pool, *inner;
+    mempool_mark_t  mark;
+    size_t          usage;
+    unsigned char   *mem;
+
+    CHECK(allocator_create(&allocator));
+    CHECK(mempool_create_unmanaged(&parent, allocator));
+    usage = mempool_usage(parent);
+    CHECK(mempool_create_lazy(&pool, parent));
+    CHECK(mempool_create_lazy(&inner, parent));
+#ifndef POOL_GUARD_FLUSH
+    /* that mode puts every block into a node of its own */
+    CHECK(mempool_usage(parent) == usage);
+#endif
+    CHECK(mempool_usage(pool) == 0 && mempool_usage(inner) == 0);
+    CHECK(mempool_check(parent));
+    mempool_destroy(inner);
+    usage = mempool_usage(parent);
+
+    /* Blocks of 0 bytes take no node, nor the parent's next block */
+    CHECK(mempool_create_lazy(&inner, parent));
+    CHECK((mem = (unsigned char *)mempool_alloc(inner, 0)) != NULL);
+    CHECK(mempool_alloc_inline(inner, 0) == mem);
+    CHECK(mempool_alloc_concurrent(inner, 0) == mem);
+    CHECK(mempool_usage(inner) == 0);
+    CHECK(mempool_alloc(parent, 1) != mem);
+    CHECK(mempool_check(parent));
+    mempool_destroy(inner);
+    usage = mempool_usage(parent);
+
+    CHECK((mem = (unsigned char *)mempool_alloc(pool, 100)) != NULL);
+    memset(mem, 0x11, 100);
+    CHECK(mempool_usage(pool) > 0 && mempool_usage(parent) > usage);
+    mempool_clear(pool);
+    CHECK(mempool_usage(pool) == 0);
+    CHECK(mempool_check(parent));
+
+    mempool_mark(parent, &mark);
+    CHECK(mempool_create_lazy(&inner, parent));
+    CHECK((mem = (unsigned char *)mempool_alloc(inner, 20000)) != NULL);
+    memset(mem, 0x22, 20000);
+    CHECK(mempool_check(parent));
+    mempool_rewind(parent, &mark);
+    CHECK(mempool_check(parent));
+    CHECK(mempool_usage(parent) == usage);
+
+    CHECK(mempool_create_lazy(&inner, pool));
+    CHECK(mempool_alloc(inner, 100) != NULL);
+    mempool_destroy(pool);
+    CHECK(mempool_check(parent));
+    CHECK(mempool_usage(parent) == usage);
+    mempool_destroy(parent);
+    CHECK(allocator_check(allocator));
+    allocator_destroy(allocator);
+}
+
+/* Blocks of mempool_calloc() are zero also where the pool handed out
+ * and dirtied the same bytes before a clear, rewind or shrink.
+ */
+static void calloc_check(void)
+{
+    mempool_t       *pool;
+    mempool_mark_t  mark;
+    unsigned char   *mem;
+    size_t          sizes[] = { 100, 5000, 300 << 10, 9 << 20 };
+
+    CHECK(mempool_create(&pool, NULL, NULL));
+    mempool_retain_set(pool, (size_t)-1, false);
+    for (int round = 0; round < 3; round++) {
+        mempool_mark(pool, &mark);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            CHECK((mem = (unsigned char *)mempool_calloc(pool, sizes[i])) != NULL);
+            CHECK(bytes_equal(mem, sizes[i], 0));
+            memset(mem, 0xff, sizes[i]);
+            CHECK((mem = (unsigned char *)mempool_realloc(pool, mem, sizes[i], 8)) != NULL);
+            CHECK((mem = (unsigned char *)mempool_calloc_aligned(pool, sizes[i], 64)) != NULL);
+            CHECK(bytes_equal(mem, sizes[i], 0));
+            memset(mem, 0xff, sizes[i]);
+        }
+        if (round == 1)
+            mempool_rewind(pool, &mark);
+        else
+            mempool_clear(pool);
+        CHECK(mempool_check(pool));
+    }
+    mempool_destroy(pool);
+}
+
+/* Aligned blocks waste less than their alignment each, in the active
+ * node as in a node of their own, up to alignments far over a node.
+ * The allocator is a private one, a shared one may hand out a larger
+ * node it has cached.
+ */
+static void aligned_check(void)
+{
+    allocator_t     *allocator;
+    mempool_t       *pool;
+    mempool_stats_t before, after;
+    unsigned char   *mem;
+    size_t          sizes[] = { 24, 4000, 70000 }, pad;
+    bool            stats;
+
+    CHECK(allocator_create(&allocator));
+    CHECK(mempool_create_unmanaged(&pool, allocator));
+    for (size_t alignment = 32; alignment <= (1 << 20); alignment <<= 1) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            stats = mempool_stats_get(pool, &before);
+            CHECK((mem = (unsigned char *)mempool_alloc_aligned(pool, sizes[i], alignment)) != NULL);
+            CHECK(((size_t)mem & (alignment - 1)) == 0);
+            memset(mem, 0x33, sizes[i]);
+            if (stats) {
+                CHECK(mempool_stats_get(pool, &after));
+                pad = (after.bytes_allocated - before.bytes_allocated)
+                    - (after.bytes_requested - before.bytes_requested);
+                CHECK(after.bytes_requested - before.bytes_requested == sizes[i]);
+                CHECK(pad < alignment);
+                /* a node of its own holds the block and its padding only */
+                CHECK(after.bytes_held - before.bytes_held <= sizes[i] + alignment + 2 * 4096);
+            }
+        }
+    }
+    CHECK(mempool_check(pool));
+    mempool_destroy(pool);
+    allocator_destroy(allocator);
+}
+
+/* A large batch of mempool_alloc_many() takes node after node the
+ * allocator can cache, 80KB at most with the default geometry, and no
+ * single huge one.
+ */
+static void many_check(void)
+{
+    allocator_t     *allocator;
+    mempool_t       *pool;
+    mempool_stats_t before, after;
+    const size_t    count = 2000, size = 1000;
+    void            **blocks;
+
+    CHECK((blocks = (void **)malloc(count * sizeof(void *))) != NULL);
+    CHECK(allocator_create(&allocator));
+    CHECK(mempool_create_unmanaged(&pool, allocator));
+    mempool_stats_get(pool, &before);
+    CHECK(mempool_alloc_many(pool, size, count, blocks));
+    for (size_t i = 0; i < count; i++)
+        memset(blocks[i], (int)i, size);
+    if (mempool_stats_get(pool, &after))
+        CHECK(after.nodes - before.nodes >= count * size / (80 << 10));
+    CHECK(mempool_check(pool));
+    mempool_destroy(pool);
+    allocator_destroy(allocator);
+    free(blocks);
+}
+
+/* Hand pools off through a shared segment and read them back through a
+ * second mapping of it, as another process would.  Every record is its
+ * length followed by as many bytes of its low byte.  The segment is too
+ * small for all the rounds unless the returned nodes are reused.
+ */
+static void shm_handoff_check(worker_t *worker)
+{
+    allocator_options_t options;
+    allocator_t     *allocator;
+    mempool_shm_t   *shm;
+    mempool_t       *pool, *child;
+    memnode_t       *batch, *node;
+    unsigned char   *mem, *end;
+    char            name[64];
+    size_t          size, records, received;
+
+    snprintf(name, sizeof(name), "/pool_stress_%llx", (unsigned long long)rng_next(worker));
+    memset(&options, 0, sizeof(options));
+    options.shm_name = name;
+    options.shm_size = 2 << 20;
+    CHECK(allocator_create_ex(&allocator, &options));
+    CHECK(mempool_shm_open(&shm, name));
+
+    CHECK(mempool_create(&pool, NULL, NULL));
+    CHECK(!mempool_handoff(pool));
+    mempool_destroy(pool);
+
+    for (int round = 0; round < 32; round++) {
+        records = received = 0;
+        for (int i = 0; i < 4; i++) {
+            CHECK(mempool_create(&pool, NULL, allocator));
+            CHECK(mempool_create(&child, pool, NULL));
+            for (int j = (int)(rng_next(worker) % 64); j > 0; j--, records++) {
+                size = (size_t)(rng_next(worker) % 3000);
+                CHECK((mem = (unsigned char *)mempool_alloc(pool, sizeof(size_t) + size)) != NULL);
+                memcpy(mem, &size, sizeof(size_t));
+                memset(mem + sizeof(size_t), (unsigned char)size, size);
+                CHECK(mempool_alloc(child, size) != NULL);
+            }
+            CHECK(mempool_handoff(pool));
+        }
+
+        while ((batch = mempool_shm_receive(shm)) != NULL) {
+            for (node = batch; node != NULL; node = mempool_shm_next(shm, node)) {
+                mem = (unsigned char *)mempool_shm_data(shm, node, &size);
+                for (end = mem + size; mem < end; received++) {
+                    memcpy(&size, mem, sizeof(size_t));
+                    CHECK(bytes_equal(mem + sizeof(size_t), size, (unsigned char)size));
+                    mem += (sizeof(size_t) + size + 7) & ~(size_t)7;
+                }
+                CHECK(mem == end);
+            }
+            mempool_shm_return(shm, batch);
+        }
+        CHECK(received == records);
+    }
+
+    CHECK(allocator_check(allocator));
+    mempool_shm_close(shm);
+    allocator_destroy(allocator);
+    CHECK(!mempool_shm_open(&shm, name));
+}
+
+static void worker_check(worker_t *worker)
+{
+    for (int i = 0; i < MAX_POOLS; i++) {
+        slot_t *slot = &worker->slots[i];
+        if (slot->pool != NULL) {
+            blocks_verify(slot);
+            if (slot->parent == -1) {
+                CHECK(mempool_check(slot->pool));
+            }
+        }
+    }
+    if (worker->allocator != NULL) {
+        CHECK(allocator_check(worker->allocator));
+    }
+}
+
+static void worker_run(worker_t *worker)
+{
+    allocator_options_t options;
+
+    /* a private allocator with a random geometry */
+    memset(&options, 0, sizeof(options));
+    options.boundary_size = (size_t)1 << (10 + rng_next(worker) % 7);
+    options.max_index = 2 + (unsigned int)(rng_next(worker) % 64);
+    /* a made-up topology, nodes that do not exist leave the memory unbound */
+    options.numa_bind = rng_next(worker) % 4 == 0;
+    options.numa_node = (unsigned int)(rng_next(worker) % 4);
+    if (!allocator_create_ex(&worker->allocator, &options)) {
+        worker->allocator = NULL;
+    }
+    CHECK(allocator_numa_pick(&worker->allocator, 0) == NULL);
+    if (worker->allocator != NULL)
+        CHECK(allocator_numa_pick(&worker->allocator, 1) == worker->allocator);
+#ifdef HAS_THREADS
+    /* every other private allocator is trimmed in the background too */
+    if (worker->allocator != NULL && rng_next(worker) % 2 == 0) {
+        CHECK(allocator_reclaimer_start(worker->allocator, 1, 0));
+    }
+#endif
+    slab_rewind_check();
+    retain_check();
+    lazy_check();
+    calloc_check();
+    aligned_check();
+    many_check();
+    shm_handoff_check(worker);
+
+    for (unsigned long n = 0; n < worker->iterations; n++) {
+        int     index = (int)(rng_next(worker) % MAX_POOLS);
+        slot_t  *slot = &worker->slots[index];
+        unsigned int op = (unsigned int)(rng_next(worker) % 100);
+
+        if (slot->pool == NULL) {
+            slot_create(worker, index);
+        }
+        else if (op < 60) {
+            slot_alloc(worker, slot);
+        }
+        else if (op < 64) {
+            slot_realloc(worker, slot);
+        }
+        else if (op < 66) {
+            slot_mark(worker, slot);
+        }
+        else if (op < 68) {
+            slot_cleanup(worker, slot);
+        }
+        else if (op < 69) {
+            slot_containers(worker, slot);
+        }
+        else if (op < 70) {
+            slot_limit(worker, slot);
+        }
+        else if (op < 75) {
+            slot_slab(worker, slot);
+        }
+        else if (op < 80) {
+            slot_alloc_many(worker, slot);
+        }
+        else if (op < 88) {
+            blocks_verify(slot);
+            mempool_clear(slot->pool);
+            /* the subpools are gone with the clear */
+            for (int i = 0; i < MAX_POOLS; i++) {
+                if (worker->slots[i].pool != NULL && worker->slots[i].parent == index)
+                    slot_forget(worker, i);
+            }
+            slot->nblocks = 0;
+            slot->nmarks = 0;
+            slot->slab = NULL;
+            slot->nobjects = 0;
+        }
+        else if (op < 96) {
+            blocks_verify(slot);
+            mempool_destroy(slot->pool);
+            slot_forget(worker, index);
+        }
+        else if (op < 97) {
+            worker_check(worker);
+        }
+        else if (worker->allocator == NULL) {
+            continue;
+        }
+        else if (op < 99) {
+            allocator_max_free_set(worker->allocator,
+                (size_t)(rng_next(worker) % 4) * (256 << 10));
+        }
+        else {
+            allocator_trim(worker->allocator, (size_t)(rng_next(worker) % 4) * (64 << 10));
+        }
+    }
+
+    worker_check(worker);
+    for (int i = 0; i < MAX_POOLS; i++) {
+        if (worker->slots[i].pool != NULL && worker->slots[i].parent == -1) {
+            mempool_destroy(worker->slots[i].pool);
+            slot_forget(worker, i);
+        }
+    }
+    if (worker->allocator != NULL) {
+        CHECK(allocator_check(worker->allocator));
+        allocator_destroy(worker->allocator);
+    }
+    CHECK(worker->cleanups_run == worker->cleanups_registered);
+}
+
+#ifdef HAS_THREADS
+#define SHARED_BLOCKS   4000
+
+/* A thread allocating from a pool shared with the others */
+typedef struct sharer_t {
+    mempool_t       *pool;
+    uint64_t        rng;
+    unsigned char   fill;
+    unsigned char   *blocks[SHARED_BLOCKS];
+    size_t          sizes[SHARED_BLOCKS];
+} sharer_t;
+
+static void *sharer_main(void *data)
+{
+    sharer_t        *sharer = (sharer_t *)data;
+    mempool_arena_t arena;
+    mempool_t       *child;
+    unsigned char   *mem;
+    size_t          size;
+
+    mempool_arena_init(&arena, sharer->pool);
+    for (int i = 0; i < SHARED_BLOCKS; i++) {
+        sharer->rng ^= sharer->rng << 13;
+        sharer->rng ^= sharer->rng >> 7;
+        sharer->rng ^= sharer->rng << 17;
+        size = (size_t)(sharer->rng >> 8) % (i % 64 == 0 ? 20000 : 300);
+        mem = (unsigned char *)(sharer->rng & 1 ? mempool_alloc_concurrent(sharer->pool, size)
+                                                : mempool_arena_alloc(&arena, size));
+        CHECK(mem != NULL && ((uintptr_t)mem & 7) == 0);
+        memset(mem, sharer->fill, size);
+        sharer->blocks[i] = mem;
+        sharer->sizes[i] = size;
+        if (i % 1000 == 0) {
+            CHECK(mempool_create(&child, sharer->pool, NULL));
+            CHECK(mempool_alloc(child, size) != NULL);
+            mempool_destroy(child);
+        }
+    }
+    return NULL;
+}
+
+/* Threads fill one concurrent pool at once, every block must keep its
+ * thread's byte.
+ */
+static void shared_check(int nthreads)
+{
+    mempool_t   *pool;
+    sharer_t    *sharers = (sharer_t *)calloc(nthreads, sizeof(sharer_t));
+    pthread_t   *threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+
+    CHECK(sharers != NULL && threads != NULL);
+    CHECK(mempool_create(&pool, NULL, NULL));
+    CHECK(mempool_concurrent_enable(pool));
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < nthreads; i++) {
+            sharers[i].pool = pool;
+            sharers[i].rng = 0x2545f4914f6cdd1dull * (round * nthreads + i + 1);
+            sharers[i].fill = (unsigned char)(i + 1);
+            CHECK(pthread_create(&threads[i], NULL, sharer_main, &sharers[i]) == 0);
+        }
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        for (int i = 0; i < nthreads; i++) {
+            for (int j = 0; j < SHARED_BLOCKS; j++)
+                CHECK(bytes_equal(sharers[i].blocks[j], sharers[i].sizes[j], sharers[i].fill));
+        }
+        CHECK(mempool_check(pool));
+        mempool_clear(pool);
+    }
+    mempool_destroy(pool);
+    free(threads);
+    free(sharers);
+}
+
+/* A thread taking nodes of a shared allocator and giving them back,
+ * touching both ends of each.
+ */
+static void *churner_main(void *data)
+{
+    allocator_t     *allocator = (allocator_t *)data;
+    memnode_t       *nodes[4];
+    memnode_head_t  *head;
+
+    for (int i = 0; i < 20000; i++) {
+        for (int j = 0; j < 4; j++) {
+            CHECK((nodes[j] = allocator_alloc(allocator, 100 + (size_t)((i + j) % 3) * 4096)) != NULL);
+            head = (memnode_head_t *)nodes[j];
+            head->first_avail[0] = (char)i;
+            head->endp[-1] = (char)i;
+        }
+        for (int j = 0; j < 4; j++)
+            allocator_free(allocator, nodes[j]);
+    }
+    return NULL;
+}
+
+/* Threads churn the nodes of an allocator that caches only a few of
+ * them while a reclaimer trims it.  The nodes over the budget go back to
+ * the system, with lock-free buckets once no racing pop can read them,
+ * and at most max_free bytes stay cached.
+ */
+static void churn_check(int nthreads)
+{
+    allocator_t         *allocator;
+    allocator_stats_t   stats;
+    pthread_t           *threads;
+    const size_t        max_free = 8 * 4096;
+
+#ifdef POOL_GUARD_PROTECT_FREED
+    /* that mode leaves a mapping behind for every node given back */
+    return;
+#endif
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    CHECK(threads != NULL);
+    CHECK(allocator_create(&allocator));
+    allocator_max_free_set(allocator, max_free);
+    CHECK(allocator_reclaimer_start(allocator, 1, 0));
+    for (int i = 0; i < nthreads; i++)
+        CHECK(pthread_create(&threads[i], NULL, churner_main, allocator) == 0);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    allocator_reclaimer_stop(allocator);
+    CHECK(allocator_check(allocator));
+    if (allocator_stats_get(allocator, &stats))
+        CHECK(stats.bytes_cached <= max_free);
+    CHECK(allocator_trim(allocator, 0) <= max_free);
+    if (allocator_stats_get(allocator, &stats))
+        CHECK(stats.bytes_cached == 0 && stats.bytes_sys == 0);
+    allocator_destroy(allocator);
+    free(threads);
+}
+
+static void *worker_main(void *data)
+{
+    worker_run((worker_t *)data);
+    return NULL;
+}
+#endif //HAS_THREADS
+
+int main(int argc, char *argv[])
+{
+    unsigned long   iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 50000;
+    int             nthreads = argc > 2 ? atoi(argv[2]) : 4;
+    worker_t        *workers;
+
+#ifndef HAS_THREADS
+    nthreads = 1;
+#endif
+    if (nthreads < 1)
+        nthreads = 1;
+
+    CHECK(pool_initialize());
+    global_limit_check();
+    workers = (worker_t *)calloc(nthreads, sizeof(worker_t));
+    CHECK(workers != NULL);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        workers[i].iterations = iterations;
+    }
+
+#ifdef HAS_THREADS
+    pthread_t *threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        CHECK(pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    shared_check(nthreads > 1 ? nthreads : 2);
+    churn_check(nthreads > 1 ? nthreads : 2);
+#else
+    worker_run(&workers[0]);
+#endif //HAS_THREADS
+
+    free(workers);
+    pool_terminate();
+    printf("%d thread(s), %lu iterations each: ok\n", nthreads, iterations);
+    return 0;
+}
\ No newline at end of file